@@ -0,0 +1,78 @@
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+#include "networkManager.hpp"
+
+/* Allocation count for the request/response life-cycle. Every operator new in the process gets 
+ * counted while 100k requests (64 at a time) go through benchServer.py, after a warm-up so the 
+ * pools are already filled. libcurl allocates with malloc so only our side shows up in here */
+
+static std::atomic<uint64_t> allocations(0);
+
+void* operator new(size_t size){
+    allocations++;
+    void* block = malloc(size ? size : 1);
+    if (block == nullptr)
+        throw std::bad_alloc();
+    return block;
+}
+void operator delete(void* block) noexcept {free(block);}
+void operator delete(void* block, size_t) noexcept {free(block);}
+
+static int finished = 0;
+static int succeeded = 0;
+
+static void onResponse(HttpResponse* resp){
+    finished++;
+    if (resp->success)
+        succeeded++;
+}
+static responseCallback benchCallback = onResponse;
+
+/* keeps `inFlight` requests going until `count` of them are done */
+static void run(networkManager &manager, const std::string &url, int count, int inFlight){
+    int sent = 0;
+    int target = finished + count;
+    while (finished < target){
+        while (sent < count && sent - (count - (target - finished)) < inFlight){
+            HttpRequest* request = manager.newRequest();
+            request->setURL(url);
+            request->addHeader("Accept: application/json");
+            request->addHeader("X-Client: networkmanager-bench");
+            request->setTag("bench-request-tag-long");
+            request->setCallback(&benchCallback);
+            manager.send(request);
+            sent++;
+        }
+        manager.visit(2000, 0);
+        if (!manager.hasResponse())
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+    }
+}
+
+int main(int argc, char const *argv[])
+{
+    std::string server = argc > 1 ? argv[1] : "http://127.0.0.1:8765";
+    int count = argc > 2 ? atoi(argv[2]) : 100000;
+    /* long enough that the URL can't hide in the small string buffer */
+    std::string url = server + "/some/longer/path/so/it/is/not/sso";
+
+    networkManager manager(new NetQueue(16));
+    run(manager, url, 2000, 64);
+    uint64_t before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    run(manager, url, count, 64);
+    uint64_t used = allocations.load() - before;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    NetStats stats = manager.getStats();
+    std::cout << count << " requests (" << succeeded << " ok) in " << ms << "ms, operator new calls " << used 
+        << " (" << static_cast<double>(used) / count << " per request)" << std::endl;
+    std::cout << "request pool hits " << stats.requestHits << " misses " << stats.requestMisses 
+        << ", buffer pool hits " << stats.bufferHits << " misses " << stats.bufferMisses << std::endl;
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+#include "networkManager.hpp"
+
+/* Bytes copied per response between write_callback and the user callback. Copying a std::string body 
+ * or tag means allocating one just as big, so every operator new in the process gets its size counted 
+ * while 2000 200KB responses come back from benchServer.py and a callback reads them three ways: 
+ * copying resp->data and getTag() like before, through body() and the const reference getters, 
+ * and by taking the buffer with takeData() */
+
+#define BENCH_RESPONSES 2000
+
+static std::atomic<uint64_t> allocatedBytes(0);
+
+void* operator new(size_t size){
+    allocatedBytes += size;
+    void* block = malloc(size ? size : 1);
+    if (block == nullptr)
+        throw std::bad_alloc();
+    return block;
+}
+void operator delete(void* block) noexcept {free(block);}
+void operator delete(void* block, size_t) noexcept {free(block);}
+
+enum class Consumer {COPY, VIEW, TAKE};
+
+static Consumer consumer = Consumer::COPY;
+static int finished = 0;
+static size_t seen = 0;
+/* the last body takeData() handed over, it's given back to the pool when the next one comes */
+static std::string kept;
+
+static void onResponse(HttpResponse* resp){
+    finished++;
+    if (consumer == Consumer::COPY){
+        std::string tag = resp->getTag();
+        std::string body = resp->data;
+        seen += body.size() + tag.size();
+    } else if (consumer == Consumer::VIEW){
+        const std::string &tag = resp->getTag();
+        BodyView body = resp->body();
+        seen += body.size() + tag.size();
+    } else {
+        const std::string &tag = resp->getTag();
+        BufferPool::shared()->release(kept);
+        kept = resp->takeData();
+        seen += kept.size() + tag.size();
+    }
+}
+static responseCallback benchCallback = onResponse;
+
+static void run(networkManager &manager, const std::string &url, int count){
+    int target = finished + count;
+    for (int i = 0; i < count; i++){
+        HttpRequest* request = manager.newRequest();
+        request->setURL(url);
+        request->setTag("a-tag-that-is-longer-than-sso");
+        request->setCallback(&benchCallback);
+        manager.send(request);
+    }
+    while (finished < target){
+        manager.visit(2000, 0);
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+static void measure(networkManager &manager, const std::string &url, Consumer how, const char* label){
+    consumer = how;
+    /* warm-up so the pools are filled for this consumer */
+    run(manager, url, 200);
+    seen = 0;
+    uint64_t before = allocatedBytes.load();
+    run(manager, url, BENCH_RESPONSES);
+    uint64_t used = allocatedBytes.load() - before;
+    std::cout << label << ": " << used / BENCH_RESPONSES << " bytes allocated per " << seen / BENCH_RESPONSES << " byte response" << std::endl;
+}
+
+int main(int argc, char const *argv[])
+{
+    std::string server = argc > 1 ? argv[1] : "http://127.0.0.1:8765";
+    std::string url = server + "/bytes/200000";
+    networkManager manager(new NetQueue(8));
+    measure(manager, url, Consumer::COPY, "copying data and getTag()");
+    measure(manager, url, Consumer::VIEW, "body() and const getters  ");
+    measure(manager, url, Consumer::TAKE, "takeData()                ");
+    return 0;
+}
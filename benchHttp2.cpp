@@ -0,0 +1,54 @@
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <thread>
+#include "networkManager.hpp"
+
+/* Fan-out over one origin with HTTP/2 off and on, 64 overlapping requests with a window of 32. 
+ * Point it at `python benchServer.py 8443 --tls cert.pem key.pem` for h2, add --no-h2 to the 
+ * server to check that the h2 mode falls back to HTTP/1.1 when it isn't negotiated */
+
+#define BENCH_REQUESTS 64
+
+static int finished = 0;
+static int succeeded = 0;
+
+static void onResponse(HttpResponse* resp){
+    finished++;
+    if (resp->success)
+        succeeded++;
+}
+static responseCallback benchCallback = onResponse;
+
+static void run(const std::string &server, bool http2){
+    finished = 0;
+    succeeded = 0;
+    NetQueue* queue = new NetQueue(32);
+    queue->setHttp2(http2);
+    networkManager manager(queue);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_REQUESTS; i++){
+        HttpRequest* request = manager.newRequest();
+        request->setURL(server + "/delay/0.05");
+        /* half of them ask for more of the connection, servers that ignore weights just treat them the same */
+        request->setStreamWeight(i % 2 ? 200 : 16);
+        request->setCallback(&benchCallback);
+        manager.send(request);
+    }
+    while (finished < BENCH_REQUESTS){
+        manager.visit(0, 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    NetStats stats = manager.getStats();
+    std::cout << "http2 " << (http2 ? "on " : "off") << ": " << succeeded << "/" << BENCH_REQUESTS << " ok in " << ms << "ms, connections opened " 
+        << stats.connectionsOpened << " reused " << stats.connectionsReused << std::endl;
+}
+
+int main(int argc, char const *argv[])
+{
+    std::string server = argc > 1 ? argv[1] : "https://127.0.0.1:8443";
+    run(server, false);
+    run(server, true);
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "networkManager.hpp"
+
+/* How long a click waits while the bulk lane is saturated. 300 slow bulk requests fill the window 
+ * and a small request goes out every 50ms, first in the bulk lane behind all of them (which is 
+ * what a single FIFO queue did) and then in the interactive lane. Needs benchServer.py running */
+
+#define BENCH_BULK 300
+#define BENCH_PROBES 40
+
+static std::vector<std::chrono::steady_clock::time_point> probeSent;
+static std::vector<double> probeMs;
+
+static void onResponse(HttpResponse* resp){
+    if (resp->getFlag() >= 0)
+        probeMs.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - probeSent[resp->getFlag()]).count());
+}
+static responseCallback probeCallback = onResponse;
+
+static void run(const std::string &server, HttpPriority probePriority, const char* label){
+    probeSent.clear();
+    probeMs.clear();
+    networkManager manager(new NetQueue(4));
+    for (int i = 0; i < BENCH_BULK; i++){
+        HttpRequest* request = manager.newRequest();
+        request->setURL(server + "/delay/0.05");
+        request->setPriority(HttpPriority::BULK);
+        request->setFlag(-1);
+        manager.send(request);
+    }
+    for (int i = 0; i < BENCH_PROBES; i++){
+        auto next = std::chrono::steady_clock::now() + std::chrono::milliseconds(50);
+        while (std::chrono::steady_clock::now() < next){
+            manager.visit(0, 0);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        HttpRequest* request = manager.newRequest();
+        request->setURL(server + "/bytes/10");
+        request->setPriority(probePriority);
+        request->setFlag(i);
+        request->setCallback(&probeCallback);
+        probeSent.push_back(std::chrono::steady_clock::now());
+        manager.send(request);
+    }
+    while (probeMs.size() < BENCH_PROBES){
+        manager.visit(0, 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::sort(probeMs.begin(), probeMs.end());
+    std::cout << label << ": p50 " << probeMs[BENCH_PROBES / 2] << "ms p99 " << probeMs[BENCH_PROBES - 1] << "ms" << std::endl;
+    /* whatever bulk work is left gets abandoned when the manager goes */
+}
+
+int main(int argc, char const *argv[])
+{
+    std::string server = argc > 1 ? argv[1] : "http://127.0.0.1:8765";
+    run(server, HttpPriority::BULK, "same lane as bulk");
+    run(server, HttpPriority::INTERACTIVE, "interactive lane");
+    return 0;
+}
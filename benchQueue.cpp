@@ -0,0 +1,77 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "mqueue.hpp"
+
+/* Submit path microbenchmark, the old mutex guarded mqueue<T> against mpscqueue<T> 
+ * with 1, 4 and 16 threads putting requests in and one daemon taking them out */
+
+#define BENCH_ITEMS 1600000
+
+struct BenchItem : mpscNode {
+    int value;
+};
+
+/* how the old requestQueue was used, every put takes the lock and allocates a node in the std::queue */
+static double benchMutexQueue(int producers, std::vector<BenchItem> &items){
+    mqueue<BenchItem*> queue;
+    size_t perProducer = items.size() / producers;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++){
+        threads.emplace_back([&queue, &items, perProducer, p](){
+            for (size_t i = 0; i < perProducer; i++){
+                queue.lock();
+                queue.put(&items[p * perProducer + i]);
+                queue.unlock();
+            }
+        });
+    }
+    size_t taken = 0;
+    while (taken < perProducer * producers){
+        queue.lock();
+        if (!queue.empty()){
+            queue.pop();
+            taken++;
+        }
+        queue.unlock();
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double benchMpscQueue(int producers, std::vector<BenchItem> &items){
+    mpscqueue<BenchItem> queue;
+    size_t perProducer = items.size() / producers;
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++){
+        threads.emplace_back([&queue, &items, perProducer, p](){
+            for (size_t i = 0; i < perProducer; i++)
+                queue.put(&items[p * perProducer + i]);
+        });
+    }
+    size_t taken = 0;
+    while (taken < perProducer * producers){
+        if (queue.pop() != nullptr)
+            taken++;
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char const *argv[])
+{
+    std::vector<BenchItem> items(BENCH_ITEMS);
+    const int producerCounts[] = {1, 4, 16};
+    for (int producers : producerCounts){
+        double locked = benchMutexQueue(producers, items);
+        double lockFree = benchMpscQueue(producers, items);
+        std::cout << producers << " producers: mqueue " << BENCH_ITEMS / locked / 1e6 << " Mops/s, mpscqueue " 
+            << BENCH_ITEMS / lockFree / 1e6 << " Mops/s" << std::endl;
+    }
+    return 0;
+}
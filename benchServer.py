@@ -0,0 +1,146 @@
+# Local stand-in server for the benchmarks, so they don't depend on (or hammer) a real site. 
+# python benchServer.py [port]                               plain HTTP/1.1 (port 8765 by default)
+# python benchServer.py [port] --tls cert.pem key.pem        https that negotiates h2, needs `pip install h2`
+# python benchServer.py [port] --tls cert.pem key.pem --no-h2   https that only offers http/1.1, for testing the fallback
+#   /delay/<seconds>   answers after sleeping that long
+#   /bytes/<n>         n bytes of body
+#   anything else      a tiny "ok"
+# A throwaway certificate does fine since the library doesn't verify peers:
+#   openssl req -x509 -newkey rsa:2048 -nodes -keyout key.pem -out cert.pem -days 365 -subj /CN=127.0.0.1
+
+import socket
+import ssl
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+
+def body_for(path):
+    parts = path.split("?")[0].strip("/").split("/")
+    if parts[0] == "delay" and len(parts) > 1:
+        time.sleep(float(parts[1]))
+        return b"slept " + parts[1].encode()
+    if parts[0] == "bytes" and len(parts) > 1:
+        return b"x" * int(parts[1])
+    return b"ok"
+
+
+class StandIn(BaseHTTPRequestHandler):
+    # keep-alive, like a real server would
+    protocol_version = "HTTP/1.1"
+    # headers and body go out in separate writes, without this every response eats a delayed ACK
+    disable_nagle_algorithm = True
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        body = body_for(self.path)
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def do_POST(self):
+        length = int(self.headers.get("Content-Length") or 0)
+        if length:
+            self.rfile.read(length)
+        self.do_GET()
+
+
+class H2Connection(object):
+    """One h2 connection, every stream gets answered on its own thread so a /delay doesn't hold up the others"""
+
+    def __init__(self, sock):
+        import h2.config
+        import h2.connection
+        self.sock = sock
+        self.conn = h2.connection.H2Connection(config=h2.config.H2Configuration(client_side=False, header_encoding="utf-8"))
+        self.lock = threading.Lock()
+        # bodies still waiting on the client's flow control window
+        self.pending = {}
+
+    def flush(self, stream_id):
+        body = self.pending.get(stream_id, b"")
+        while body:
+            size = min(self.conn.local_flow_control_window(stream_id), self.conn.max_outbound_frame_size, len(body))
+            if size <= 0:
+                break
+            self.conn.send_data(stream_id, body[:size])
+            body = body[size:]
+        if body:
+            self.pending[stream_id] = body
+        else:
+            self.pending.pop(stream_id, None)
+            self.conn.end_stream(stream_id)
+
+    def respond(self, stream_id, path):
+        body = body_for(path)
+        with self.lock:
+            self.conn.send_headers(stream_id, [(":status", "200"), ("content-type", "text/plain"), ("content-length", str(len(body)))])
+            self.pending[stream_id] = body
+            self.flush(stream_id)
+            self.sock.sendall(self.conn.data_to_send())
+
+    def serve(self):
+        import h2.events
+        with self.lock:
+            self.conn.initiate_connection()
+            self.sock.sendall(self.conn.data_to_send())
+        while True:
+            data = self.sock.recv(65536)
+            if not data:
+                break
+            with self.lock:
+                for event in self.conn.receive_data(data):
+                    if isinstance(event, h2.events.RequestReceived):
+                        path = dict(event.headers).get(":path", "/")
+                        threading.Thread(target=self.respond, args=(event.stream_id, path), daemon=True).start()
+                    elif isinstance(event, h2.events.DataReceived):
+                        self.conn.acknowledge_received_data(event.flow_controlled_length, event.stream_id)
+                    elif isinstance(event, h2.events.WindowUpdated):
+                        for stream_id in list(self.pending):
+                            self.flush(stream_id)
+                self.sock.sendall(self.conn.data_to_send())
+
+
+def serve_tls(port, cert, key, offer_h2):
+    context = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH)
+    context.load_cert_chain(cert, key)
+    context.set_alpn_protocols(["h2", "http/1.1"] if offer_h2 else ["http/1.1"])
+    listener = socket.create_server(("127.0.0.1", port))
+    # the http/1.1 side reuses StandIn, it only needs something that looks like a server
+    fallback = ThreadingHTTPServer(("127.0.0.1", 0), StandIn)
+
+    def handle(client, address):
+        try:
+            tls = context.wrap_socket(client, server_side=True)
+            if tls.selected_alpn_protocol() == "h2":
+                H2Connection(tls).serve()
+            else:
+                StandIn(tls, address, fallback)
+        except (OSError, ssl.SSLError):
+            pass
+        finally:
+            client.close()
+
+    print("benchServer listening on https://127.0.0.1:%d (%s)" % (port, "h2 and http/1.1" if offer_h2 else "http/1.1 only"))
+    while True:
+        client, address = listener.accept()
+        client.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        threading.Thread(target=handle, args=(client, address), daemon=True).start()
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    port = int(args[0]) if args and args[0].isdigit() else 8765
+    if "--tls" in args:
+        at = args.index("--tls")
+        serve_tls(port, args[at + 1], args[at + 2], "--no-h2" not in args)
+    else:
+        server = ThreadingHTTPServer(("127.0.0.1", port), StandIn)
+        server.daemon_threads = True
+        print("benchServer listening on http://127.0.0.1:%d" % port)
+        server.serve_forever()
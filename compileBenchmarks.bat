@@ -0,0 +1,8 @@
+@set INCLUDES= /I include /I include/pthreads
+@set LIBS= include/link/libssl.lib include/link/libcurl_a.lib include/link/libcrypto.lib include/link/libpthreadVC3.lib Ws2_32.lib User32.lib Advapi32.lib Crypt32.lib Wldap32.lib Normaliz.lib  
+@set EXTRA=out
+CL /O2 /EHsc benchQueue.cpp include/link/libpthreadVC3.lib %INCLUDES% /FebenchQueue.exe /Fo%EXTRA%/
+CL /O2 /EHsc -DCURL_STATICLIB benchLanes.cpp src/networkManager.cpp %LIBS% %INCLUDES% /FebenchLanes.exe /Fo%EXTRA%/
+CL /O2 /EHsc -DCURL_STATICLIB benchHttp2.cpp src/networkManager.cpp %LIBS% %INCLUDES% /FebenchHttp2.exe /Fo%EXTRA%/
+CL /O2 /EHsc -DCURL_STATICLIB benchAlloc.cpp src/networkManager.cpp %LIBS% %INCLUDES% /FebenchAlloc.exe /Fo%EXTRA%/
+CL /O2 /EHsc -DCURL_STATICLIB benchCopies.cpp src/networkManager.cpp %LIBS% %INCLUDES% /FebenchCopies.exe /Fo%EXTRA%/
@@ -6,3 +6,4 @@
 @set FILENAME=test
 @set EXTRA=out
 CL -DCURL_STATICLIB %FILES% %LIBS% %INCLUDES% /Fe%FILENAME%.exe /Fo%EXTRA%/
+CL -DCURL_STATICLIB src/networkManager.cpp testHostLimit.cpp %LIBS% %INCLUDES% /FetestHostLimit.exe /Fo%EXTRA%/
@@ -33,6 +33,7 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define __MQUEUE_H__
 
 #include <queue>
+#include <atomic>
 #include <pthreads/pthread.h>
 
 
@@ -42,6 +43,7 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 template<typename T>
 class mqueue {
     std::queue<T> m_queue;
+protected:
     pthread_mutex_t m_mutex;
 public:
 
@@ -95,7 +97,7 @@ public:
 
     /* waits for a signal from our condition variable */
     int wait(){
-        return pthread_cond_wait(&m_cond, &m_mutex);
+        return pthread_cond_wait(&m_cond, &this->m_mutex);
     }
 
     int broadcast(){
@@ -108,4 +110,159 @@ public:
     }
 };
 
+
+
+/* the hook an object needs to carry to be put inside of an mpscqueue, 
+ * an object can only sit inside of one mpscqueue at a time */
+struct mpscNode {
+    std::atomic<mpscNode*> m_mpscNext;
+    mpscNode() : m_mpscNext(nullptr) {}
+    /* copies are never inside of a queue, whatever they were copied from */
+    mpscNode(const mpscNode&) : m_mpscNext(nullptr) {}
+    mpscNode& operator=(const mpscNode&) { return *this; }
+};
+
+
+/* Lock-free Multi-Producer Single-Consumer queue (Dmitry Vyukov's intrusive design)
+ * T has to inherit from mpscNode. put() can be called from any thread and is a 
+ * single atomic exchange with no allocation, pop() may only ever be called from one 
+ * thread at a time. pop() can return nullptr for a moment while a producer is halfway 
+ * through put(), so producers should poke the consumer after putting something in */
+template <typename T>
+class mpscqueue {
+    std::atomic<mpscNode*> m_head;
+    /* only ever touched by the consumer */
+    mpscNode* m_tail;
+    mpscNode m_stub;
+
+    void push(mpscNode* node){
+        node->m_mpscNext.store(nullptr, std::memory_order_relaxed);
+        mpscNode* prev = m_head.exchange(node, std::memory_order_acq_rel);
+        prev->m_mpscNext.store(node, std::memory_order_release);
+    }
+
+public:
+    mpscqueue() : m_head(&m_stub), m_tail(&m_stub) {}
+
+    /* non-copyable, the stub lives inside of us */
+    mpscqueue(const mpscqueue&) = delete;
+    mpscqueue& operator=(const mpscqueue&) = delete;
+
+    void put(T* item){
+        push(static_cast<mpscNode*>(item));
+    }
+
+    /* consumer only, returns nullptr when there's nothing (finished) to take */
+    T* pop(){
+        mpscNode* tail = m_tail;
+        mpscNode* next = tail->m_mpscNext.load(std::memory_order_acquire);
+        if (tail == &m_stub){
+            if (next == nullptr)
+                return nullptr;
+            m_tail = next;
+            tail = next;
+            next = next->m_mpscNext.load(std::memory_order_acquire);
+        }
+        if (next != nullptr){
+            m_tail = next;
+            return static_cast<T*>(tail);
+        }
+        /* a producer has swapped the head but hasn't linked it up yet */
+        if (tail != m_head.load(std::memory_order_acquire))
+            return nullptr;
+
+        /* tail is the last real node, push the stub behind it so we can hand it out */
+        push(&m_stub);
+        next = tail->m_mpscNext.load(std::memory_order_acquire);
+        if (next != nullptr){
+            m_tail = next;
+            return static_cast<T*>(tail);
+        }
+        return nullptr;
+    }
+};
+
+
+/* size of a cache line on everything we care about, used for padding */
+#define MQUEUE_CACHELINE 64
+
+/* Wait-free bounded Single-Producer Single-Consumer ring buffer. One thread 
+ * calls push(), one other thread calls empty()/front()/pop() and neither of them 
+ * ever waits on the other. The producer's and the consumer's indices sit on 
+ * their own cache lines so the two threads don't keep stealing the line from 
+ * each other, each side also keeps a cached copy of the other side's index so 
+ * it only has to look at the shared one when the ring looks full/empty. */
+template <typename T>
+class spscring {
+    /* consumer side */
+    std::atomic<size_t> m_head;
+    size_t m_cachedTail;
+    char m_padHead[MQUEUE_CACHELINE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+    /* producer side */
+    std::atomic<size_t> m_tail;
+    size_t m_cachedHead;
+    char m_padTail[MQUEUE_CACHELINE - sizeof(std::atomic<size_t>) - sizeof(size_t)];
+
+    size_t m_mask;
+    T* m_items;
+
+public:
+    /* capacity gets rounded up to a power of two */
+    spscring(size_t capacity = 1024) : m_head(0), m_cachedTail(0), m_tail(0), m_cachedHead(0) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        m_mask = size - 1;
+        m_items = new T[size];
+    }
+
+    ~spscring(){
+        delete[] m_items;
+    }
+
+    spscring(const spscring&) = delete;
+    spscring& operator=(const spscring&) = delete;
+
+    size_t capacity() const {
+        return m_mask + 1;
+    }
+
+    /* producer only, returns false when the ring is full */
+    bool push(const T &item){
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_cachedHead > m_mask){
+            m_cachedHead = m_head.load(std::memory_order_acquire);
+            if (tail - m_cachedHead > m_mask)
+                return false;
+        }
+        m_items[tail & m_mask] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* consumer only */
+    bool empty(){
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head != m_cachedTail)
+            return false;
+        m_cachedTail = m_tail.load(std::memory_order_acquire);
+        return head == m_cachedTail;
+    }
+
+    /* consumer only, check empty() first */
+    T& front(){
+        return m_items[m_head.load(std::memory_order_relaxed) & m_mask];
+    }
+
+    /* consumer only, check empty() first */
+    void pop(){
+        m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    /* safe from either side but only a rough number since the other side keeps moving */
+    size_t size() const {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+    }
+};
+
 #endif // __MQUEUE_H__
\ No newline at end of file
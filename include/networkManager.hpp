@@ -34,13 +34,23 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <memory>
 #include <vector>
 #include <string>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
 
 
 /* helper class objects */
 #include "mqueue.hpp"
 
 
-/* Inspired by Libcocos */
+/* string_view is only around from C++17 onwards, BodyView works without it */
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#include <string_view>
+#define NETWORKMANAGER_STRING_VIEW
+#endif
+
+
+/* Inspired by Libcocos, getters hand out a const reference so reading a string property doesn't copy it */
 #ifndef MYPROPERTY
 #define MYPROPERTY(varType, varName, funName)                 \
                                                                  \
@@ -48,10 +58,10 @@ protected:                                                       \
     varType varName;                                             \
                                                                  \
 public:                                                          \
-    varType get##funName(void) const { return varName; } \
+    varType const &get##funName(void) const { return varName; } \
                                                                  \
 public:                                                          \
-    void set##funName(varType var) { varName = var; }
+    void set##funName(varType const &var) { varName = var; }
 #endif /* MYPROPERTY */
 
 
@@ -61,6 +71,66 @@ class HttpResponse;
 /* handles callbacks */
 typedef void (*responseCallback)(HttpResponse* resp);
 
+/* handles chunks of a response body as they come in (on the daemon's thread), return false to abort the transfer */
+typedef bool (*chunkCallback)(HttpResponse* resp, const char* data, size_t size, void* userdata);
+
+
+
+/* Where a response body goes while it's being downloaded, by default every body is kept in 
+ * HttpResponse::data but a sink set with HttpRequest::setSink() gets each chunk instead. 
+ * Everything in here is called from the daemon's thread, never the main-thread */
+class ResponseSink {
+public:
+    virtual ~ResponseSink(){}
+
+    /* called for every chunk curl hands us, returning false aborts the transfer */
+    virtual bool write(HttpResponse* resp, const char* data, size_t size) = 0;
+
+    /* called once the transfer is over (or failed to start) right before the response is 
+     * handed to the main-thread, returning false marks the response as a failure */
+    virtual bool finish(HttpResponse* /*resp*/, bool success){return success;}
+};
+
+/* The default, keeps the whole body in HttpResponse::data (or spills it to disk when it's huge) */
+class MemorySink : public ResponseSink {
+public:
+    bool write(HttpResponse* resp, const char* data, size_t size) override;
+};
+
+/* Streams the body into a file through a fixed size buffer so memory stays flat no matter 
+ * how big the download is. The file is removed again if the request fails */
+class FileSink : public ResponseSink {
+    std::string m_path;
+    FILE* m_file;
+    std::vector<char> m_buffer;
+    size_t m_used;
+    uint64_t m_written;
+
+    bool flush();
+public:
+    FileSink(const std::string &path, size_t bufferSize = 64 * 1024);
+    ~FileSink();
+
+    bool write(HttpResponse* resp, const char* data, size_t size) override;
+    bool finish(HttpResponse* resp, bool success) override;
+
+    const std::string &getPath() const {return m_path;}
+    /* how much of the body made it to the file */
+    uint64_t getBytesWritten() const {return m_written;}
+};
+
+/* Hands every chunk to your own chunkCallback on the daemon's thread */
+class ChunkSink : public ResponseSink {
+    chunkCallback m_callback;
+    void* m_userdata;
+public:
+    ChunkSink(chunkCallback callback, void* userdata = nullptr) : m_callback(callback), m_userdata(userdata) {}
+
+    bool write(HttpResponse* resp, const char* data, size_t size) override {
+        return m_callback(resp, data, size, m_userdata);
+    }
+};
+
 
 
 enum class HttpType {
@@ -68,11 +138,73 @@ enum class HttpType {
     POST
 };
 
+/* Which lane a request waits in before a daemon picks it up, lanes are served strictly 
+ * in this order so a click the user is waiting on never sits behind background work */
+enum class HttpPriority {
+    INTERACTIVE,
+    NORMAL,
+    BULK,
+    PREFETCH
+};
+
+/* how many HttpPriority lanes there are */
+#define HTTP_PRIORITY_LANES 4
+
+/* How a request deals with the NetQueue's ResponseCache (when it has one) */
+enum class HttpCacheMode {
+    /* answer from the cache when we can and store what comes back */
+    USE,
+    /* always go to the network but still store what comes back, used for background revalidation */
+    REFRESH,
+    /* never look at or touch the cache */
+    BYPASS
+};
+
+/* What went wrong with a request, worked out from its CURLcode and status */
+enum class HttpError {
+    NONE,
+    /* the host's name couldn't be resolved */
+    DNS,
+    /* nobody answered on the other end */
+    CONNECT,
+    /* the TLS handshake or certificate check failed, retrying won't help */
+    TLS,
+    TIMEOUT,
+    /* the connection dropped or came back empty partway through */
+    NETWORK,
+    /* a 5xx */
+    SERVER,
+    /* a 429 or Cloudflare's 1015 */
+    RATE_LIMITED,
+    /* any other 4xx, retrying won't help */
+    CLIENT,
+    /* everything else, like a body that was too big or a sink that gave up */
+    OTHER
+};
+
+/* how many kinds of HttpError there are */
+#define HTTP_ERROR_KINDS 10
+
 /* NOTE: Anything protected or non-public as an 'm_' prefix in it's name */
 
-class HttpRequest {
-    /* multidict */
-    std::vector<std::string>m_headers;
+/* how many idle requests, responses and transfers each pool holds onto for reuse */
+#define NETWORKMANAGER_POOL_LIMIT 1024
+
+/* strings bigger than this (like a large post body) aren't worth keeping around when a request gets recycled */
+#define HTTPREQUEST_RETAIN_BYTES 4096
+
+/* HttpRequest is an mpscNode so that it can be put onto a shard's lock-free request queue without allocating */
+class HttpRequest : public mpscNode {
+    /* multidict, every header is stored back to back in one buffer with a '\0' after each 
+     * one so that a recycled request can take new headers without allocating */
+    std::string m_headerArena;
+    size_t m_headerCount;
+    /* If-None-Match/If-Modified-Since the ResponseCache wants sent, laid out like m_headerArena. They go out 
+     * with the headers but stay out of getHeaders() so the request you sent is never changed behind your back */
+    std::string m_validatorArena;
+    size_t m_validatorCount;
+    /* where the body goes, nullptr keeps it in HttpResponse::data */
+    std::shared_ptr<ResponseSink> m_sink;
     MYPROPERTY(std::string, m_postFields , PostFields);
     MYPROPERTY(std::string, m_proxy, Proxy);
     MYPROPERTY(HttpType, m_req, RequestType)
@@ -82,75 +214,446 @@ class HttpRequest {
     MYPROPERTY(int32_t, m_timeout, Timeout);
     MYPROPERTY(std::string, m_url, URL);
     MYPROPERTY(responseCallback*, m_onResponse, Callback)
+    /* defaults to HttpPriority::NORMAL */
+    MYPROPERTY(HttpPriority, m_priority, Priority)
+    /* HTTP/2 stream weight from 1 to 256, only used when NetQueue::setHttp2(true), 0 leaves it at the default of 16 */
+    MYPROPERTY(int32_t, m_streamWeight, StreamWeight)
+    /* the biggest body we're willing to take in bytes, anything that says it's bigger (or turns out to be) 
+     * fails right away. 0 means no limit */
+    MYPROPERTY(uint64_t, m_maxBodySize, MaxBodySize)
+    /* defaults to HttpCacheMode::USE, which does nothing unless NetQueue::setCacheSize() was given a size */
+    MYPROPERTY(HttpCacheMode, m_cacheMode, CacheMode)
+    /* How many times the request may go out in total, 1 (the default) never retries. Only transient errors 
+     * (DNS, CONNECT, TIMEOUT, NETWORK, SERVER and RATE_LIMITED) are retried, after RetryDelay milliseconds 
+     * growing by RetryBackoff times each attempt up to RetryMaxDelay. RetryJitter is how much of each 
+     * delay is random (0 to 1) so a crowd of failed requests doesn't come back all at once */
+    MYPROPERTY(int32_t, m_maxAttempts, MaxAttempts)
+    MYPROPERTY(int32_t, m_retryDelay, RetryDelay)
+    MYPROPERTY(int32_t, m_retryMaxDelay, RetryMaxDelay)
+    MYPROPERTY(double, m_retryBackoff, RetryBackoff)
+    MYPROPERTY(double, m_retryJitter, RetryJitter)
+    /* whether it's safe to send the request twice, GETs always are. A POST that isn't only gets retried 
+     * when it never reached the server (DNS, CONNECT and RATE_LIMITED) */
+    MYPROPERTY(bool, m_idempotent, Idempotent)
+    /* opt-in hedging for idempotent reads, when the request hasn't heard back by NetQueue::getHedgePercentile() 
+     * of its endpoint's recent latency a second copy goes out (through HedgeProxy if it's set) and whichever 
+     * one finishes first wins, the other gets cancelled. Requests with a sink are never hedged */
+    MYPROPERTY(bool, m_hedge, Hedge)
+    MYPROPERTY(std::string, m_hedgeProxy, HedgeProxy)
+    /* how many times the request has gone out */
+    int32_t m_attempts;
+    /* when send() got it and when a daemon first started on it, they end up in HttpResponse::timing */
+    std::chrono::steady_clock::time_point m_submitted;
+    std::chrono::steady_clock::time_point m_dequeued;
 
 public:    
-    HttpRequest(): m_postFields("") , m_proxy("") , m_tag(""), m_timeout(60){
+    HttpRequest(): m_headerCount(0), m_validatorCount(0), m_postFields("") , m_proxy("") , m_tag(""), m_flag(0), m_timeout(60){
         m_req = HttpType::GET;
         m_onResponse = nullptr;
+        m_priority = HttpPriority::NORMAL;
+        m_streamWeight = 0;
+        m_maxBodySize = 0;
+        m_cacheMode = HttpCacheMode::USE;
+        m_maxAttempts = 1;
+        m_retryDelay = 250;
+        m_retryMaxDelay = 10000;
+        m_retryBackoff = 2.0;
+        m_retryJitter = 0.5;
+        m_idempotent = false;
+        m_attempts = 0;
+        m_hedge = false;
     }
     
-    std::vector<std::string> getHeaders(){return m_headers;}
-    void addHeader(const std::string &header){return m_headers.push_back(header);}
+    std::vector<std::string> getHeaders();
+    void addHeader(const std::string &header){
+        m_headerArena.append(header.c_str(), header.size() + 1);
+        m_headerCount++;
+    }
+
+    /* the raw header buffer, getHeaderCount() strings each ending in a '\0' */
+    const char* getHeaderArena() const {return m_headerArena.c_str();}
+    size_t getHeaderCount() const {return m_headerCount;}
+
+    /* used by the ResponseCache to revalidate a stale entry */
+    void addValidator(const std::string &header){
+        m_validatorArena.append(header.c_str(), header.size() + 1);
+        m_validatorCount++;
+    }
+    const char* getValidatorArena() const {return m_validatorArena.c_str();}
+    size_t getValidatorCount() const {return m_validatorCount;}
+
+    /* how many times the daemon has sent the request out so far, countAttempt() is called each time it does */
+    int32_t getAttempts() const {return m_attempts;}
+    int32_t countAttempt(){return ++m_attempts;}
+
+    std::chrono::steady_clock::time_point getSubmitted() const {return m_submitted;}
+    std::chrono::steady_clock::time_point getDequeued() const {return m_dequeued;}
+    void markSubmitted(std::chrono::steady_clock::time_point when){m_submitted = when;}
+    /* only the first time counts, a retry or a held request being let go doesn't move it */
+    void markDequeued(std::chrono::steady_clock::time_point when){
+        if (m_dequeued == std::chrono::steady_clock::time_point())
+            m_dequeued = when;
+    }
+
+    /* streams the response body somewhere other than HttpResponse::data (see FileSink and ChunkSink), 
+     * the request keeps a reference so you don't have to hold onto the sink yourself */
+    void setSink(std::shared_ptr<ResponseSink> sink){m_sink = sink;}
+    ResponseSink* getSink() const {return m_sink.get();}
+
+    /* puts everything back the way the constructor left it while keeping hold of the string memory */
+    void recycle();
+
     ~HttpRequest(){
-        m_headers.clear();
+        m_headerArena.clear();
+    }
+};
+
+
+/* Keeps finished HttpRequests around so networkManager::newRequest() can hand one back out 
+ * instead of allocating a new request (and all of its strings) every time */
+class RequestPool {
+    std::vector<HttpRequest*> m_free;
+    pthread_mutex_t m_mutex;
+
+    RequestPool();
+    ~RequestPool();
+
+public:
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+
+    /* shared by every networkManager, never destroyed for the same reason as BufferPool::shared() */
+    static RequestPool* shared();
+
+    HttpRequest* acquire();
+
+    /* recycles the request, or deletes it once the pool already has NETWORKMANAGER_POOL_LIMIT of them */
+    void release(HttpRequest* request);
+
+    /* deletes every pooled request */
+    void trim();
+};
+
+/* has a unique_ptr hand its HttpRequest back to the RequestPool instead of deleting it */
+struct RequestRecycler {
+    void operator()(HttpRequest* request) const;
+};
+
+
+/* Keeps the raw memory of objects of type T that get made and thrown away for every request 
+ * (HttpResponse and the daemon's transfers) on a free-list, T opts in by routing its own 
+ * operator new/delete through here. Memory handed back past NETWORKMANAGER_POOL_LIMIT is freed */
+template <class T>
+class SlabPool {
+    std::vector<void*> m_free;
+    pthread_mutex_t m_mutex;
+
+    SlabPool(){
+        pthread_mutex_init(&m_mutex, nullptr);
+        /* so that deallocate() never has to allocate while holding the lock */
+        m_free.reserve(NETWORKMANAGER_POOL_LIMIT);
+    }
+
+public:
+    /* one per type and never destroyed since objects can be deleted during static destruction */
+    static SlabPool* shared(){
+        static SlabPool* pool = new SlabPool();
+        return pool;
+    }
+
+    void* allocate(){
+        pthread_mutex_lock(&m_mutex);
+        if (!m_free.empty()){
+            void* block = m_free.back();
+            m_free.pop_back();
+            pthread_mutex_unlock(&m_mutex);
+            return block;
+        }
+        pthread_mutex_unlock(&m_mutex);
+        return ::operator new(sizeof(T));
+    }
+
+    void deallocate(void* block){
+        pthread_mutex_lock(&m_mutex);
+        if (m_free.size() < NETWORKMANAGER_POOL_LIMIT){
+            m_free.push_back(block);
+            pthread_mutex_unlock(&m_mutex);
+            return;
+        }
+        pthread_mutex_unlock(&m_mutex);
+        ::operator delete(block);
+    }
+
+    void trim(){
+        pthread_mutex_lock(&m_mutex);
+        for (size_t i = 0; i < m_free.size(); i++)
+            ::operator delete(m_free[i]);
+        m_free.clear();
+        pthread_mutex_unlock(&m_mutex);
     }
 };
 
 
-class HttpResponse {
+/* smallest and largest size class BufferPool keeps, as powers of two (4KB and 8MB) */
+#define BUFFERPOOL_MIN_SHIFT 12
+#define BUFFERPOOL_MAX_SHIFT 23
+#define BUFFERPOOL_CLASSES (BUFFERPOOL_MAX_SHIFT - BUFFERPOOL_MIN_SHIFT + 1)
+
+/* A process-wide pool of response body buffers bucketed by power of two size classes, 
+ * HttpResponse borrows its `data` from here and hands it back when it's deleted so a 
+ * steady stream of responses stops churning the allocator on both the daemons and the 
+ * main-thread. Buffers that nobody has needed in a while get released by trim(). */
+class BufferPool {
+    struct Entry {
+        std::string buffer;
+        std::chrono::steady_clock::time_point returned;
+    };
+    /* each class has its own lock since buffers come back on the main-thread while daemons take them */
+    std::vector<Entry> m_classes[BUFFERPOOL_CLASSES];
+    pthread_mutex_t m_locks[BUFFERPOOL_CLASSES];
+    std::atomic<size_t> m_bytes;
+    /* the most the pool holds onto in total, anything coming back past this just gets freed */
+    std::atomic<size_t> m_maxBytes;
+
+    BufferPool();
+    ~BufferPool();
+
+public:
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+
+    /* the one every HttpResponse uses, it's never destroyed so responses can outlive static destructors */
+    static BufferPool* shared();
+
+    /* an empty string with at least `capacity` bytes reserved */
+    std::string acquire(size_t capacity);
+
+    /* takes buffer's memory back (buffer is left empty), buffers below the smallest class are ignored */
+    void release(std::string &buffer);
+
+    /* frees every buffer that has been sitting in the pool for more than maxIdle seconds, 0 frees them all */
+    void trim(int32_t maxIdle);
+
+    size_t pooledBytes(){return m_bytes.load();}
+    size_t getMaxBytes(){return m_maxBytes.load();}
+    void setMaxBytes(size_t maxBytes){m_maxBytes.store(maxBytes);}
+};
+
+
+/* A read-only look at a response body that works the same whether the body is sitting in 
+ * HttpResponse::data or was spilled to a memory-mapped temp file, it's only good for as long as the response is */
+class BodyView {
+    const char* m_data;
+    size_t m_size;
+public:
+    BodyView(const char* data = nullptr, size_t size = 0) : m_data(data), m_size(size) {}
+
+    const char* data() const {return m_data;}
+    size_t size() const {return m_size;}
+    bool empty() const {return m_size == 0;}
+    const char* begin() const {return m_data;}
+    const char* end() const {return m_data + m_size;}
+    char operator[](size_t i) const {return m_data[i];}
+
+    /* copies the body out into a std::string */
+    std::string str() const {return m_size == 0 ? std::string() : std::string(m_data, m_size);}
+
+#ifdef NETWORKMANAGER_STRING_VIEW
+    std::string_view view() const {return std::string_view(m_data, m_size);}
+    operator std::string_view() const {return view();}
+#endif
+};
+
+/* a response body that got too big to keep in memory, defined in networkManager.cpp */
+class SpillFile;
+
+
+/* Where the time went for a request, every duration is in microseconds. The network side comes from curl 
+ * and covers the last attempt, each phase is only how long that one step took so a reused connection 
+ * has no dns, connect or tls time. The time points are ours and show how much of the wait was spent 
+ * queued up or waiting for visit() rather than on the network */
+struct HttpTiming {
+    /* resolving the host's name */
+    int64_t dns;
+    /* the TCP handshake (or QUIC's) */
+    int64_t connect;
+    /* the TLS handshake, 0 for plain http */
+    int64_t tls;
+    /* from the connection being ready to the first byte of the response, mostly the server thinking */
+    int64_t wait;
+    /* from the first byte of the response to the last */
+    int64_t transfer;
+    /* following redirects, before any of the above */
+    int64_t redirect;
+    /* from the start of the transfer up to the first byte and up to the end, redirects included */
+    int64_t firstByte;
+    int64_t total;
+    /* what went over the wire, headers included */
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+    /* rode on a connection that was already open */
+    bool reused;
+    /* 10, 11, 20 or 30 for HTTP/1.0, 1.1, 2 and 3, 0 if it never got that far */
+    int32_t httpVersion;
+
+    /* send() was called */
+    std::chrono::steady_clock::time_point submitted;
+    /* a daemon started on it for the first time, anything a rate limit held it back for comes before this */
+    std::chrono::steady_clock::time_point dequeued;
+    /* the daemon was done with it */
+    std::chrono::steady_clock::time_point completed;
+    /* visit() handed it to the callback */
+    std::chrono::steady_clock::time_point delivered;
+
+    HttpTiming() : dns(0), connect(0), tls(0), wait(0), transfer(0), redirect(0), firstByte(0), total(0), 
+        bytesSent(0), bytesReceived(0), reused(false), httpVersion(0) {}
+
+    /* microseconds between two of the time points above, 0 if either one never happened */
+    static int64_t between(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to){
+        if (from == std::chrono::steady_clock::time_point() || to == std::chrono::steady_clock::time_point() || to < from)
+            return 0;
+        return std::chrono::duration_cast<std::chrono::microseconds>(to - from).count();
+    }
+
+    /* waiting in a lane (or on a rate limit) before a daemon started on it */
+    int64_t queued() const {return between(submitted, dequeued);}
+    /* done but waiting for visit() to get around to it */
+    int64_t handoff() const {return between(completed, delivered);}
+    /* from send() until the callback */
+    int64_t endToEnd() const {return between(submitted, delivered);}
+    /* all of endToEnd() that wasn't the network: queueing, retry backoff, our own work and handoff */
+    int64_t overhead() const {
+        int64_t ours = endToEnd() - total;
+        return ours > 0 ? ours : 0;
+    }
+};
+
+/* HttpResponse is an mpscNode so that cache hits can reach the main-thread through a lock-free queue */
+class HttpResponse : public mpscNode {
     /* a retained reference to the http request we made so we can access tags and debug our requests 
-     * soon after leaving the daemon, this unique_ptr never leaves or is moved and acts as a handle/ref */
-    std::unique_ptr<HttpRequest, std::default_delete<HttpRequest>> m_request;
+     * soon after leaving the daemon, this unique_ptr never leaves or is moved and acts as a handle/ref. 
+     * When the response is deleted the request goes back to the RequestPool */
+    std::unique_ptr<HttpRequest, RequestRecycler> m_request;
+    /* where the body went once it grew past m_spillThreshold bytes, nullptr while it's still in `data`. 
+     * Coalesced responses share it with each other */
+    std::shared_ptr<SpillFile> m_spill;
+    /* a body shared between every response of a coalesced request (see NetQueue::setCoalesce()), 
+     * nullptr unless shareBody() was called. Nobody writes to it once it's shared */
+    std::shared_ptr<std::string> m_sharedBody;
+    size_t m_spillThreshold;
+    /* how many body bytes curl has handed us so far, wherever they went */
+    uint64_t m_received;
 public:
     
-    /* TODO Maybe a Good Idea to carry the CURLcode to be able to 
-    better daignose any problems that a user may bump into */
     bool success;
     int status;
+    /* the CURLcode of the last attempt (0 is CURLE_OK), what kind of failure it was and how many attempts it took */
+    int32_t curlCode;
+    HttpError error;
+    int32_t attempts;
+    /* the body, unless it was spilled to disk (see isSpilled()) or shared with other responses (see isShared()), body() works either way */
     std::string data;
 
+    /* picked out of the response headers as they come in, contentLength is -1 when the server didn't send one */
+    int64_t contentLength;
+    std::string contentType;
+    std::string contentEncoding;
+    /* validators and freshness the cache goes by */
+    std::string etag;
+    std::string lastModified;
+    std::string cacheControl;
+    /* seconds the server asked us to wait with Retry-After, -1 when it didn't */
+    int32_t retryAfter;
+    /* the body came out of the ResponseCache instead of being downloaded */
+    bool cached;
+    /* how long each part of the request took, see HttpTiming */
+    HttpTiming timing;
+
     /* our libcurl write callback to write our response to `data` */
     static size_t write_callback(void *data, size_t size, size_t nmemb, void *clientp);
-    HttpResponse() : data(""), success(false), status(0) {}
-    ~HttpResponse(){
-        m_request.reset();
-    }
+
+    /* our libcurl header callback, sizes `data` up front from Content-Length so the body never has to be regrown */
+    static size_t header_callback(char *buffer, size_t size, size_t nitems, void *clientp);
+
+    HttpResponse() : m_spill(nullptr), m_spillThreshold(0), m_received(0), success(false), status(0), curlCode(0), error(HttpError::NONE), attempts(0), data(""), contentLength(-1), retryAfter(-1), cached(false) {}
+    ~HttpResponse();
+
+    /* the whole body whether it's in `data`, a memory-mapped temp file or shared with other responses */
+    BodyView body() const;
+    bool isSpilled() const {return m_spill != nullptr;}
+    bool isShared() const {return m_sharedBody != nullptr;}
+    /* how many body bytes curl has handed over, wherever they went */
+    uint64_t getBytesReceived() const {return m_received;}
+
+    /* bodies that would grow past this many bytes move to a temp file instead, 0 never spills. 
+     * The daemon sets this from NetQueue::getSpillThreshold() */
+    void setSpillThreshold(size_t threshold){m_spillThreshold = threshold;}
+    size_t getSpillThreshold() const {return m_spillThreshold;}
+
+    /* adds onto the body, spilling it to disk if it gets too big */
+    bool appendBody(const char* chunk, size_t size);
+
+    /* gets room for a body of `size` bytes before it arrives (a few MB at most, anything past that grows as it comes in), 
+     * straight onto disk if it's past the spill threshold */
+    bool reserveBody(size_t size);
+
+    /* called on the daemon once the body is complete, maps a spilled body so body() can see it */
+    bool sealBody();
     
+    /* Called on the daemon to fan a coalesced response out, `other` gets our status, headers and a reference to our body. 
+     * Our own body moves out of `data` the first time so both of us can point at the same buffer */
+    void shareBody(HttpResponse* other);
+
+    /* takes the body for yourself without copying it (`data` is left empty), a spilled or shared body has to be copied out though. 
+     * Hand the string to BufferPool::shared()->release() once you're done with it so it gets reused */
+    std::string takeData();
+
     int32_t getFlag(){return m_request->getFlag();}
-    std::string getTag(){return m_request->getTag();}
+    const std::string &getTag(){return m_request->getTag();}
 
     HttpRequest* getRequest(){ return m_request.get();}
     void setRequest(HttpRequest* req){m_request.reset(req);}
+    /* takes the request back out so it can be sent again, the response is left without one */
+    HttpRequest* releaseRequest(){return m_request.release();}
+
+    /* responses are made and deleted for every request so their memory comes from a SlabPool, 
+     * anything bigger (a subclass) goes straight to the allocator */
+    static void* operator new(size_t size){
+        return size == sizeof(HttpResponse) ? SlabPool<HttpResponse>::shared()->allocate() : ::operator new(size);
+    }
+    static void operator delete(void* block, size_t size){
+        if (size == sizeof(HttpResponse))
+            SlabPool<HttpResponse>::shared()->deallocate(block);
+        else
+            ::operator delete(block);
+    }
 
 };
 
 
 
 
-/* A Boolean with a mutex */
+/* A Boolean that's safe to share between threads, it used to carry a mutex but 
+ * it's a lock-free atomic now. lock() and unlock() are no-ops that are only 
+ * kept around so that older code which locked it still compiles */
 class BoolContainer {
-    pthread_mutex_t m_mutex;
-    MYPROPERTY(bool, m_value, Value);
+    std::atomic<bool> m_value;
 public:
-    BoolContainer(){
-        m_value = false;
-        pthread_mutex_init(&m_mutex, nullptr);
-    }
+    BoolContainer() : m_value(false) {}
+
+    bool getValue() const { return m_value.load(); }
+    void setValue(bool value) { m_value.store(value); }
 
     bool operator==(bool value){
-        return m_value == value;
+        return m_value.load() == value;
     }
 
     int lock(){
-        return pthread_mutex_lock(&m_mutex);
+        return 0;
     }
 
     int unlock(){
-        return pthread_mutex_unlock(&m_mutex);
-    }
-
-    ~BoolContainer(){
-        pthread_mutex_destroy(&m_mutex);
+        return 0;
     }
 };
 
@@ -192,46 +695,310 @@ public:
 };
 
 
+/* Where one host's limits are at right now */
+struct HostStats {
+    /* host[:port] as it was in the URL */
+    std::string host;
+    /* how many transfers the host is allowed at once (0 when it isn't limited) and how many it has going */
+    int32_t concurrencyLimit;
+    int32_t inFlight;
+    /* requests waiting for the host's rate or concurrency limit */
+    int32_t held;
+    /* requests a second we're letting through, 0 when the host isn't rate limited */
+    double rate;
+    /* smoothed time to first byte */
+    double rttMs;
+};
+
+/* A snapshot of NetQueue's counters, Handy for checking that keep-alive is actually doing something */
+struct NetStats {
+    /* easy handles that were recycled from the daemon's pool vs. freshly made with curl_easy_init */
+    uint64_t poolHits;
+    uint64_t poolMisses;
+    /* finished transfers that rode on a kept-alive connection vs. connections that had to be opened */
+    uint64_t connectionsReused;
+    uint64_t connectionsOpened;
+    /* response bodies that got a recycled buffer from the BufferPool vs. a fresh allocation, and how much it's holding */
+    uint64_t bufferHits;
+    uint64_t bufferMisses;
+    uint64_t bufferBytesPooled;
+    /* networkManager::newRequest() calls that got a recycled HttpRequest vs. a new one */
+    uint64_t requestHits;
+    uint64_t requestMisses;
+    /* ResponseCache lookups answered fresh, answered stale (while revalidating in the background) or not at all */
+    uint64_t cacheHits;
+    uint64_t cacheStaleHits;
+    uint64_t cacheMisses;
+    /* 304s that let us keep a cached body, and new entries that W-TinyLFU turned away */
+    uint64_t cacheRevalidated;
+    uint64_t cacheRejected;
+    uint64_t cacheBytes;
+    /* lookups that missed memory but were found on disk, and how big the disk tier's log is */
+    uint64_t cacheDiskHits;
+    uint64_t cacheDiskBytes;
+    /* requests that were attached to an identical one already in-flight instead of going out themselves */
+    uint64_t coalesced;
+    /* requests a host's rate or concurrency limit held back for a while, and 429/503/1015 responses that slowed a host down */
+    uint64_t rateLimited;
+    uint64_t throttled;
+    /* failed attempts that were scheduled to go out again */
+    uint64_t retries;
+    /* second copies sent for slow hedged requests and how many of them finished first, 
+     * plus how long hedged requests have been taking from start to finish lately */
+    uint64_t hedges;
+    uint64_t hedgeWins;
+    double hedgedP50Ms;
+    double hedgedP99Ms;
+    /* every host the daemons have talked to */
+    std::vector<HostStats> hosts;
+};
+
+/* values up to 7 get a bucket each, from there every power of two is split into 8 buckets so 
+ * a value is never off by more than 12.5%. Anything past 2^40 (12 days in microseconds) lands in the last one */
+#define METRICS_HISTOGRAM_BUCKETS 304
+
+/* A copy of one of the registry's latency histograms, every value is in microseconds */
+struct HistogramSnapshot {
+    uint64_t count;
+    uint64_t sum;
+    /* the biggest value recorded */
+    uint64_t highest;
+    std::vector<uint64_t> buckets;
+
+    HistogramSnapshot() : count(0), sum(0), highest(0) {}
+
+    /* the value `p` (0 to 1) of the way through everything recorded, 0 when it's empty */
+    uint64_t percentile(double p) const;
+    double mean() const {return count > 0 ? static_cast<double>(sum) / count : 0.0;}
+
+    /* which bucket `value` goes in and the smallest value past that bucket */
+    static size_t bucketOf(uint64_t value);
+    static uint64_t bucketEnd(size_t bucket);
+};
+
+/* Everything the registry knows about one tag (HttpRequest::getTag()) and host */
+struct MetricsSeries {
+    std::string tag;
+    std::string host;
+    /* requests that finished after going out to the network, retried attempts aren't counted again */
+    uint64_t requests;
+    /* how many of those finished with each HttpError, indexed by the enum, errors[0] are the ones that didn't */
+    uint64_t errors[HTTP_ERROR_KINDS];
+    uint64_t retries;
+    /* requests the ResponseCache answered without going out at all */
+    uint64_t cacheHits;
+    /* requests that rode on a connection that was already open */
+    uint64_t connectionsReused;
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+    /* HttpTiming::queued(), firstByte and total */
+    HistogramSnapshot queued;
+    HistogramSnapshot firstByte;
+    HistogramSnapshot total;
+};
+
+/* A copy of the whole registry taken with NetQueue::getMetrics() */
+struct MetricsSnapshot {
+    std::vector<MetricsSeries> series;
+
+    /* renders everything in Prometheus' text format, histograms are cut down to the usual 1ms to 10s buckets */
+    std::string toPrometheus() const;
+};
+
+
+/* One daemon thread with its own curl_multi handle and request queue, NetQueue sends 
+ * every request for the same host to the same shard so that host's connections stay warm 
+ * and handles never have to move between threads. Defined in networkManager.cpp */
+struct NetShard;
+
+/* How long responses from any URL containing `pattern` stay fresh, in seconds, and for how much 
+ * longer after that a stale copy may still be handed out while it's revalidated in the background. 
+ * A ttl of 0 keeps matching URLs out of the cache. Rules are how POST reads (getGJLevels21 and co.) get cached */
+struct CacheRule {
+    std::string pattern;
+    int32_t ttl;
+    int32_t staleWhileRevalidate;
+};
+
+/* A token bucket for every host matching `host` (the host itself or any subdomain of it, "*" matches every host), 
+ * `rate` requests a second with up to `burst` of them back to back. Hosts are slowed down on their own when 
+ * they answer with 429, 503 or Cloudflare's 1015 and sped back up once they stop, with or without a rule */
+struct RateLimit {
+    std::string host;
+    double rate;
+    int32_t burst;
+};
+
+/* A sharded, size bounded in-memory cache that sits in front of NetQueue::send(), keyed on the 
+ * method, the URL and a hash of the post fields. New entries are admitted with W-TinyLFU and plain 
+ * GETs are revalidated with ETag/Last-Modified. Defined in networkManager.cpp */
+struct ResponseCache;
+
+/* The requests currently in-flight that others can be attached to, keyed on the method, the URL and 
+ * hashes of the post fields and headers. Defined in networkManager.cpp */
+struct InflightTable;
+
+/* Counters and latency histograms for every tag and host, the daemons update it without taking a lock. 
+ * Defined in networkManager.cpp */
+struct MetricsRegistry;
+
+
 /* Used to carry queue data and is the middle-man and parent Object for all http related stuff */
 class NetQueue {
     BoolContainer m_close;
-
-    template<class T>
-    void drainQueue(mqueue<T> queue){
-        /* lock the queues before draining because I don't know who else plans 
-         * to use this library */
-        queue.lock();
-        while (!queue.empty()){
-            auto resp = responseQueue.get();
-            delete resp;
-        }
-        queue.unlock();
-    }
+    std::vector<std::unique_ptr<NetShard>> m_shards;
+    /* shards whose daemon hasn't exited yet, the last one out wakes up mayclose */
+    std::atomic<int32_t> m_liveShards;
+    /* the shard that visit() is going to look at first, rotated so one busy shard can't starve the rest */
+    size_t m_visitCursor;
+
+    /* nullptr unless setCacheSize() was given a size before init() */
+    std::unique_ptr<ResponseCache> m_cache;
+    std::vector<CacheRule> m_cacheRules;
+    /* read by the daemons, add them before init() */
+    std::vector<RateLimit> m_rateLimits;
+    /* cache hits skip the daemons entirely and wait in here for visit() */
+    mpscqueue<HttpResponse> m_cacheHits;
+    std::atomic<size_t> m_cacheHitCount;
+    /* the hit getResponse() already took out of m_cacheHits but hasn't been popped yet, main-thread only */
+    HttpResponse* m_nextCacheHit;
+    /* whether getResponse() last handed out a cache hit, so popResponse() takes the same one */
+    bool m_peekedCacheHit;
+    /* the shard (and its index) whose response getResponse() last handed out, so popResponse() pops 
+     * that one even if a shard further up the rotation got a response in between. main-thread only */
+    NetShard* m_peekedShard;
+    size_t m_peekedShardIndex;
+    /* nullptr unless setCoalesce(true) was called before init() */
+    std::unique_ptr<InflightTable> m_inflight;
+    /* nullptr unless setCollectMetrics(true) was called before init() */
+    std::unique_ptr<MetricsRegistry> m_metrics;
+
+    /* the shard holding the next response or nullptr, main-thread only. `index` gets its place in m_shards */
+    NetShard* nextResponseShard(size_t* index = nullptr);
+
+    /* requests sent before init() made the shards, init() routes them once it has */
+    std::vector<HttpRequest*> m_early;
+
+    /* hands a request to the daemon that owns its host, past the cache */
+    void route(HttpRequest* req);
+
+    /* send() past markSubmitted(), the disk cache's worker calls it again with `diskChecked` set once it has read a record back */
+    void submit(HttpRequest* req, bool diskChecked);
+
+    /* deletes every response that hasn't been visited, main-thread only */
+    void drainResponses();
+
+    /* how many daemon threads (shards) to launch in init(), each one gets its own curl_multi handle */
+    MYPROPERTY(int32_t, m_shardCount, ShardCount);
+    /* how many transfers curl_multi is allowed to drive at once on each daemon */
+    MYPROPERTY(int32_t, m_maxConcurrency, MaxConcurrency);
+    /* seconds a kept-alive connection or a pooled handle may sit unused before it gets reaped */
+    MYPROPERTY(int32_t, m_idleTimeout, IdleTimeout);
+    /* seconds between each sweep of the daemon's handle pool */
+    MYPROPERTY(int32_t, m_reapInterval, ReapInterval);
+    /* how many finished responses each shard can have waiting for visit() before the daemon has to hold onto them */
+    MYPROPERTY(int32_t, m_responseCapacity, ResponseCapacity);
+    /* slots of each daemon's concurrency window that only HttpPriority::INTERACTIVE requests 
+     * may take, so a window full of background work still has room for a click */
+    MYPROPERTY(int32_t, m_reservedSlots, ReservedSlots);
+    /* after this many requests in a row have been picked by strict priority, one of the lower 
+     * lanes gets the next turn so background work can't starve forever (0 turns this off) */
+    MYPROPERTY(int32_t, m_starvationLimit, StarvationLimit);
+    /* opt-in HTTP/2, transfers to the same origin get multiplexed over one TLS connection 
+     * and anything that doesn't negotiate h2 (or isn't https) quietly stays on HTTP/1.1 */
+    MYPROPERTY(bool, m_http2, Http2);
+    /* with HTTP/2 on, how many streams may share a connection before a new one gets opened */
+    MYPROPERTY(int32_t, m_maxStreams, MaxStreams);
+    /* bodies bigger than this many bytes get spilled to a memory-mapped temp file, 0 keeps everything in memory */
+    MYPROPERTY(size_t, m_spillThreshold, SpillThreshold);
+    /* how many bytes of responses the ResponseCache may hold, 0 (the default) turns the cache off. Set it before init() */
+    MYPROPERTY(size_t, m_cacheSize, CacheSize);
+    /* a directory for the cache's disk tier so the cache survives restarts, empty (the default) keeps it in memory only. 
+     * On a cold start anything found on disk is shown right away while it's revalidated in the background. 
+     * The disk tier gets a thread of its own so reading and writing it never holds up send() or a daemon */
+    MYPROPERTY(std::string, m_diskCachePath, DiskCachePath);
+    /* how many bytes the disk tier may take up before it compacts down to half of that */
+    MYPROPERTY(size_t, m_diskCacheSize, DiskCacheSize);
+    /* opt-in single-flight, a request that's identical to one still in-flight waits for that one 
+     * instead of going out again and every callback gets its own response once it lands. 
+     * Those responses share one body so read them through body() since `data` is left empty. 
+     * Requests with a sink always go out on their own. Set it before init() */
+    MYPROPERTY(bool, m_coalesce, Coalesce);
+    /* the longest a throttled host gets paused for in seconds, whatever its Retry-After says */
+    MYPROPERTY(int32_t, m_maxBackoff, MaxBackoff);
+    /* how many transfers a host starts out being allowed at once, from there each host learns its own limit 
+     * (up to MaxConcurrency) from how fast and how healthy its responses are. 0 lets any host take the whole window */
+    MYPROPERTY(int32_t, m_hostConcurrency, HostConcurrency);
+    /* how far into an endpoint's recent time to first byte a hedged request waits before its second copy goes out */
+    MYPROPERTY(double, m_hedgePercentile, HedgePercentile);
+    /* the most second copies each daemon sends, as a fraction of the hedged requests it's started (0.05 is 5%) */
+    MYPROPERTY(double, m_hedgeBudget, HedgeBudget);
+    /* opt-in metrics, keeps counters and latency histograms for every tag and host (see getMetrics()). 
+     * Only the first 768 tag and host pairs get their own series, the rest are lumped into one. Set it before init() */
+    MYPROPERTY(bool, m_collectMetrics, CollectMetrics);
 
 public:
     BoolContainer threadIsAlive;
     Condition mayclose;
-    mqueue<HttpRequest*> requestQueue;
-    mqueue<HttpResponse*> responseQueue;
-    NetQueue(){};
+    /* written by the daemon only, read them through getStats() */
+    std::atomic<uint64_t> m_poolHits;
+    std::atomic<uint64_t> m_poolMisses;
+    std::atomic<uint64_t> m_connectionsReused;
+    std::atomic<uint64_t> m_connectionsOpened;
+    std::atomic<uint64_t> m_rateLimited;
+    std::atomic<uint64_t> m_throttled;
+    std::atomic<uint64_t> m_retries;
+    std::atomic<uint64_t> m_hedges;
+    std::atomic<uint64_t> m_hedgeWins;
+
+    NetQueue(int32_t maxConcurrency = 16, int32_t shardCount = 1);
 
 
-    /* parent Thread of our thread's life-cycle */
+    /* parent Thread of a shard's life-cycle, args is the NetShard it drives */
     static void* RaiiThread(void* args);
 
-    /* Releases a daemon to run our Life-cycle object */
+    /* the disk cache's worker, args is the NetQueue whose cache it reads and writes */
+    static void* DiskThread(void* args);
+
+    /* Releases a daemon per shard to run our Life-cycle object */
     void init();
 
-    /* sends out our http request off to the lauched http daemon. */
+    /* adds a CacheRule, the first rule whose pattern shows up in a URL wins. Add them before init() */
+    void addCacheRule(const std::string &pattern, int32_t ttl, int32_t staleWhileRevalidate = 0);
+
+    /* adds a RateLimit, the first one matching a host wins. Requests a host isn't ready 
+     * for wait on their daemon instead of going out to be rejected. Add them before init() */
+    void addRateLimit(const std::string &host, double rate, int32_t burst = 1);
+
+    /* sends out our http request off to the daemon that owns the request's host. */
     void send(HttpRequest* req);
 
-    bool hasResponse(){return !responseQueue.empty();}
+    /* every shard hands its responses over through its own wait-free ring so none of these 
+     * ever block on a daemon, they're meant to be called from one thread (the main-thread) */
+    bool hasResponse(){return m_cacheHitCount > 0 || nextResponseShard() != nullptr;}
+
+    /* peeks at the next response or returns nullptr, it stays queued until popResponse() */
+    HttpResponse* getResponse();
+
+    /* removes the response getResponse() returned, it's up to you to delete it */
+    void popResponse();
+
+    /* roughly how many finished responses are waiting to be visited */
+    size_t pendingResponses();
+
+    NetStats getStats();
 
-    HttpResponse* getResponse(){return responseQueue.get();};
+    /* copies the metrics registry out, empty unless setCollectMetrics(true) was called. It only reads 
+     * atomics so it's fine to call from any thread while transfers are going */
+    MetricsSnapshot getMetrics();
+
+    /* writes getMetrics() to `path` in Prometheus' text format through a temp file, so a scraper 
+     * (like node_exporter's textfile collector) never sees half of it. Returns false if it couldn't */
+    bool writeMetrics(const std::string &path);
 
     bool ShouldCloseDaemon();
 
-    /* Tells the NetQueue Thread to close */
+    /* Tells the NetQueue Threads to close and wakes them up so they notice right away */
     void CloseDaemon();
 
     /* shedules to have Daemon close on it's next cycle and drains the queues out */
@@ -239,7 +1006,7 @@ public:
     
     /* mainly used to block other threads until NetQueue's MainThread has been closed or shutdown.
     `Wanring` Do not put this on the main Thread or render loop */
-    void waitForClose(){mayclose.wait();};
+    void waitForClose();
     ~NetQueue();
 };
 
@@ -247,14 +1014,25 @@ public:
 /* used to manage networking Life-Cycles */
 class networkManager {
     std::unique_ptr<NetQueue, std::default_delete<NetQueue>>m_nq;
+
+    /* runs the response's callback and deletes it */
+    void dispatch(HttpResponse* resp);
 public:
     networkManager(){
         m_nq.reset(new NetQueue);
         m_nq->init();
     };
 
-    /* used to help create an http request to allow the user to conifigure the required http request */
-    HttpRequest* newRequest() {return new HttpRequest;}
+    /* takes ownership of a NetQueue you've configured yourself (max-concurrency, etc...) 
+     * and launches it, don't call init() on it beforehand */
+    networkManager(NetQueue* nq){
+        m_nq.reset(nq);
+        m_nq->init();
+    };
+
+    /* used to help create an http request to allow the user to conifigure the required http request, 
+     * requests are recycled once their response is deleted so this rarely has to allocate */
+    HttpRequest* newRequest() {return RequestPool::shared()->acquire();}
     
     /* submits the http request back to our memory pool to be sent off */
     void send(HttpRequest* request){
@@ -263,12 +1041,29 @@ public:
 
     bool hasResponse(){return m_nq->hasResponse();};
 
+    NetStats getStats(){return m_nq->getStats();};
+
+    MetricsSnapshot getMetrics(){return m_nq->getMetrics();};
+
     /* returns a nullptr if there's no response avalibe to queue */
-    HttpResponse* getResponse(){return m_nq->hasResponse() ? m_nq->getResponse() : nullptr;};
+    HttpResponse* getResponse(){return m_nq->getResponse();};
+
+    /* removes the response getResponse() gave you from the queue, deleting it is on you */
+    void popResponse(){m_nq->popResponse();};
+
+    /* Hands every pooled response buffer, request and response back to the allocator, handy when your app gets minimized. 
+     * The daemons already trim buffers that haven't been used for NetQueue::getIdleTimeout() seconds */
+    void trimBuffers();
 
     /* Visits network manager to render on the main-thread */
     void visit();
 
+    /* Batch styled visitation, keeps delivering callbacks until budgetMicros microseconds 
+     * have gone by or maxResponses callbacks have been made (0 means no limit for either), 
+     * at least one response gets delivered if there is one so a tiny budget still makes progress. 
+     * Returns how many responses are still pending so you can tell if you're falling behind */
+    size_t visit(uint32_t budgetMicros, uint32_t maxResponses = 0);
+
     /* Gets a global network manager and allocates the object if it doesn't exist */
     static networkManager* sharedState();
 
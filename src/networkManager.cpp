@@ -32,12 +32,46 @@ OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * library with a class object to monitor and destory 
  * the http thread loop */
 
+/* windows.h comes in through curl.h (and further down for the file mapping), without these 
+ * its min and max macros would eat every std::min, std::max and time_point::max() in here */
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+
 #include <curl/curl.h>
 #include <pthreads/pthread.h>
 #include <cstdint>
+#include <cstring>
+#include <cstdio>
 #include <string>
 #include <vector>
 #include <memory>
+#include <chrono>
+#include <deque>
+#include <cctype>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include <ctime>
+#include <cmath>
+#include <queue>
+#include <random>
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
 
 #include "networkManager.hpp"
 
@@ -68,13 +102,19 @@ public:
     curl_slist* m_headers;
     CURL* m_curl;
 
-    Curl() : m_curl(curl_easy_init()), m_headers(nullptr){}
+    Curl() : m_headers(nullptr), m_curl(curl_easy_init()){}
+
+    /* wraps a handle that came out of a CurlPool */
+    Curl(CURL* handle) : m_headers(nullptr), m_curl(handle){}
 
     /* Same As libcocos's init function but with some newly added features as well as proxy support */
     /* TODO: Configure Threading support and mutexes */
     bool init(
         const std::string &URL,
-        std::vector<std::string>headers, 
+        const char* headerArena, 
+        size_t headerCount, 
+        const char* validatorArena, 
+        size_t validatorCount, 
         write_callback callback, 
         void *stream, 
         int32_t timeout = 60,
@@ -88,19 +128,29 @@ public:
                 return false;
         }
 
-        for (size_t i = 0; i < headers.size(); i++ ){
-            m_headers = curl_slist_append(m_headers, headers[i].c_str());
+        /* walk the request's header buffer, each header ends where its '\0' is */
+        const char* header = headerArena;
+        for (size_t i = 0; i < headerCount; i++ ){
+            m_headers = curl_slist_append(m_headers, header);
+            if (m_headers == nullptr) return false;
+            header += strlen(header) + 1;
+        }
+        /* and the cache's validators, which are laid out the same way */
+        header = validatorArena;
+        for (size_t i = 0; i < validatorCount; i++ ){
+            m_headers = curl_slist_append(m_headers, header);
             if (m_headers == nullptr) return false;
+            header += strlen(header) + 1;
         }
         if (!setOption(CURLOPT_HTTPHEADER, m_headers))
             return false;
 
         /* Robtop's server Admin portal says it can take up to 5 minutes to respond so we set the CURLOPT_Timeout to 300 seonds */
-        auto code = curl_easy_setopt(m_curl, CURLOPT_TIMEOUT, 300);
+        auto code = curl_easy_setopt(m_curl, CURLOPT_TIMEOUT, 300L);
         if (code != CURLE_OK) {
             return false;
         }
-        code = curl_easy_setopt(m_curl, CURLOPT_CONNECTTIMEOUT, timeout);
+        code = curl_easy_setopt(m_curl, CURLOPT_CONNECTTIMEOUT, static_cast<long>(timeout));
         if (code != CURLE_OK) {
             return false;
         }
@@ -121,24 +171,38 @@ public:
         return CURLE_OK == curl_easy_setopt(m_curl, option, arg);
     }
 
-    // template <class T>
-    // CURLcode getInfo(CURLINFO info, T* arg){
-    //     return curl_easy_getinfo(m_curl, arg);
-    // }
+    template <class T>
+    bool getInfo(CURLINFO info, T* arg){
+        return CURLE_OK == curl_easy_getinfo(m_curl, info, arg);
+    }
 
-    /* performs an HTTP Request */
-    bool perform(int *Status){
-        if (curl_easy_perform(m_curl) != CURLE_OK){
+    /* checks the outcome of a transfer that curl_multi has finished driving for us */
+    bool complete(CURLcode result, int *Status){
+        if (result != CURLE_OK){
             return false;
         }
-       
-        CURLcode code = curl_easy_getinfo(m_curl, CURLINFO_HTTP_CODE, Status);
+
+        /* curl writes a long here, which isn't the same size as an int everywhere */
+        long httpCode = 0;
+        CURLcode code = curl_easy_getinfo(m_curl, CURLINFO_HTTP_CODE, &httpCode);
+        *Status = static_cast<int>(httpCode);
         if (code != CURLE_OK || *Status != 200){
             return false;
         }
         return true;
     }
 
+    /* hands the easy handle back (so it can go back into a CurlPool) and frees our headers */
+    CURL* detach(){
+        CURL* handle = m_curl;
+        m_curl = nullptr;
+        if (m_headers != nullptr){
+            curl_slist_free_all(m_headers);
+            m_headers = nullptr;
+        }
+        return handle;
+    }
+
     ~Curl()
     {
         if (m_curl != nullptr)
@@ -150,168 +214,3697 @@ public:
 };
 
 
-/* TODO Make response have a member for CURLcode and set that to the response to daignose problems */
+/* Keeps finished easy handles around so the daemon doesn't pay for curl_easy_init 
+ * on every request, handles get wiped with curl_easy_reset before they're reused. 
+ * The pool belongs to a single daemon thread so there's no locking here. */
+class CurlPool {
+    struct Entry {
+        CURL* handle;
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+    std::vector<Entry> m_free;
+    NetQueue* m_netq;
 
-bool sendPostRequest(HttpRequest* request, HttpResponse* response){
-    Curl curl;
-    bool ok = curl.init(request->getURL(), request->getHeaders(), HttpResponse::write_callback, reinterpret_cast<void*>(response), request->getTimeout(), request->getProxy())
+public:
+    CurlPool(NetQueue* netq) : m_netq(netq) {}
+
+    bool empty(){
+        return m_free.empty();
+    }
+
+    CURL* acquire(){
+        if (!m_free.empty()){
+            /* take the most recently used handle, it's the warmest */
+            CURL* handle = m_free.back().handle;
+            m_free.pop_back();
+            m_netq->m_poolHits++;
+            return handle;
+        }
+        m_netq->m_poolMisses++;
+        return curl_easy_init();
+    }
+
+    void release(CURL* handle){
+        if (handle == nullptr) return;
+        /* no reason to keep more spare handles than we could ever run at once */
+        if ((int32_t)m_free.size() >= m_netq->getMaxConcurrency()){
+            curl_easy_cleanup(handle);
+            return;
+        }
+        /* clear the cookie file list ourselves, some libcurl versions leak it on reset */
+        curl_easy_setopt(handle, CURLOPT_COOKIEFILE, static_cast<char*>(nullptr));
+        curl_easy_reset(handle);
+        Entry entry = {handle, std::chrono::steady_clock::now()};
+        m_free.push_back(entry);
+    }
+
+    /* frees handles that have been sitting around for longer than maxIdle seconds */
+    void reap(int32_t maxIdle){
+        auto cutoff = std::chrono::steady_clock::now() - std::chrono::seconds(maxIdle);
+        size_t kept = 0;
+        for (size_t i = 0; i < m_free.size(); i++){
+            if (m_free[i].lastUsed < cutoff){
+                curl_easy_cleanup(m_free[i].handle);
+            } else {
+                m_free[kept++] = m_free[i];
+            }
+        }
+        m_free.resize(kept);
+    }
+
+    void clear(){
+        for (size_t i = 0; i < m_free.size(); i++)
+            curl_easy_cleanup(m_free[i].handle);
+        m_free.clear();
+    }
+
+    ~CurlPool(){
+        clear();
+    }
+};
+
+
+/* One curl share handle for the whole process so that every transfer, no matter 
+ * which daemon or NetQueue it came from, reuses the same DNS cache, TLS sessions 
+ * and cookie jar. Each kind of shared data gets its own rwlock so a DNS lookup 
+ * never waits on somebody writing a cookie. Daemons hold a reference for as 
+ * long as they run and the last one out cleans up.
+ *
+ * NOTE: connections are NOT put in here, libcurl doesn't support a shared 
+ * connection cache between threads that run transfers at the same time. Each 
+ * daemon's multi handle already keeps one connection cache for all of its 
+ * transfers, and a fresh connection from another daemon resumes its TLS 
+ * session from the share instead of doing the full handshake. */
+class CurlShare {
+    CURLSH* m_share;
+    pthread_rwlock_t m_locks[CURL_LOCK_DATA_LAST];
+    int32_t m_refs;
+
+    static pthread_mutex_t s_mutex;
+    static CurlShare* s_instance;
+
+    static void lock(CURL* /*handle*/, curl_lock_data data, curl_lock_access access, void* userptr){
+        CurlShare* share = reinterpret_cast<CurlShare*>(userptr);
+        if (access == CURL_LOCK_ACCESS_SHARED)
+            pthread_rwlock_rdlock(&share->m_locks[data]);
+        else
+            pthread_rwlock_wrlock(&share->m_locks[data]);
+    }
+
+    static void unlock(CURL* /*handle*/, curl_lock_data data, void* userptr){
+        CurlShare* share = reinterpret_cast<CurlShare*>(userptr);
+        pthread_rwlock_unlock(&share->m_locks[data]);
+    }
+
+    CurlShare() : m_share(curl_share_init()), m_refs(0) {
+        for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+            pthread_rwlock_init(&m_locks[i], nullptr);
+
+        if (m_share == nullptr) return;
+        curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, CurlShare::lock);
+        curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, CurlShare::unlock);
+        curl_share_setopt(m_share, CURLSHOPT_USERDATA, reinterpret_cast<void*>(this));
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+        curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_COOKIE);
+    }
+
+    ~CurlShare(){
+        if (m_share != nullptr)
+            curl_share_cleanup(m_share);
+        for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+            pthread_rwlock_destroy(&m_locks[i]);
+    }
+
+public:
+    /* grabs a reference to the process-wide share, creating it if we're the first */
+    static CURLSH* acquire(){
+        pthread_mutex_lock(&s_mutex);
+        if (s_instance == nullptr){
+            curl_global_init(CURL_GLOBAL_ALL);
+            s_instance = new CurlShare();
+        }
+        s_instance->m_refs++;
+        CURLSH* share = s_instance->m_share;
+        pthread_mutex_unlock(&s_mutex);
+        return share;
+    }
+
+    /* only call this once every handle using the share has been cleaned up or reset */
+    static void release(){
+        pthread_mutex_lock(&s_mutex);
+        if (s_instance != nullptr && --s_instance->m_refs <= 0){
+            delete s_instance;
+            s_instance = nullptr;
+        }
+        pthread_mutex_unlock(&s_mutex);
+    }
+};
+
+pthread_mutex_t CurlShare::s_mutex = PTHREAD_MUTEX_INITIALIZER;
+CurlShare* CurlShare::s_instance = nullptr;
+
+
+bool preparePostRequest(Curl &curl, HttpRequest* request, HttpResponse* response){
+    return curl.init(request->getURL(), request->getHeaderArena(), request->getHeaderCount(), request->getValidatorArena(), request->getValidatorCount(), HttpResponse::write_callback, reinterpret_cast<void*>(response), request->getTimeout(), request->getProxy())
             && curl.setOption(CURLOPT_COOKIE, "gd=1;")
             && curl.setOption(CURLOPT_POST, 1)
             && curl.setOption(CURLOPT_POSTFIELDSIZE, request->getPostFields().size())
             && curl.setOption(CURLOPT_COPYPOSTFIELDS, request->getPostFields().c_str());
-    
-    return ok && curl.perform(&response->status);
 }
 
-bool sendGetRequest(HttpRequest* request, HttpResponse* response){
-    Curl curl;
-    bool ok = curl.init(request->getURL(), request->getHeaders(), HttpResponse::write_callback, reinterpret_cast<void*>(response), request->getTimeout(), request->getProxy())
+bool prepareGetRequest(Curl &curl, HttpRequest* request, HttpResponse* response){
+    return curl.init(request->getURL(), request->getHeaderArena(), request->getHeaderCount(), request->getValidatorArena(), request->getValidatorCount(), HttpResponse::write_callback, reinterpret_cast<void*>(response), request->getTimeout(), request->getProxy())
             && curl.setOption(CURLOPT_COOKIE, "gd=1;")
             && curl.setOption(CURLOPT_HTTPGET, 1);
-    return ok && curl.perform(&response->status);
+}
+
+
+/* asks for h2 over TLS (falling back to HTTP/1.1 when the server won't do it) and has the 
+ * transfer wait for an existing connection to multiplex onto instead of opening its own */
+bool prepareHttp2(Curl &curl, HttpRequest* request){
+    bool ok = curl.setOption(CURLOPT_HTTP_VERSION, static_cast<long>(CURL_HTTP_VERSION_2TLS))
+            && curl.setOption(CURLOPT_PIPEWAIT, 1L);
+    if (ok && request->getStreamWeight() > 0){
+        long weight = request->getStreamWeight() > 256 ? 256 : request->getStreamWeight();
+        ok = curl.setOption(CURLOPT_STREAM_WEIGHT, weight);
+    }
+    return ok;
+}
+
+
+std::vector<std::string> HttpRequest::getHeaders(){
+    std::vector<std::string> headers;
+    headers.reserve(m_headerCount);
+    const char* header = m_headerArena.c_str();
+    for (size_t i = 0; i < m_headerCount; i++){
+        headers.push_back(header);
+        header += headers.back().size() + 1;
+    }
+    return headers;
+}
+
+/* clear() keeps a string's capacity, big ones get swapped out with an empty string to really let go of them */
+static void recycleString(std::string &str){
+    if (str.capacity() > HTTPREQUEST_RETAIN_BYTES)
+        std::string().swap(str);
+    else
+        str.clear();
+}
+
+void HttpRequest::recycle(){
+    recycleString(m_headerArena);
+    m_headerCount = 0;
+    recycleString(m_validatorArena);
+    m_validatorCount = 0;
+    recycleString(m_postFields);
+    recycleString(m_proxy);
+    recycleString(m_tag);
+    recycleString(m_url);
+    m_req = HttpType::GET;
+    m_flag = 0;
+    m_timeout = 60;
+    m_onResponse = nullptr;
+    m_priority = HttpPriority::NORMAL;
+    m_streamWeight = 0;
+    m_maxBodySize = 0;
+    m_cacheMode = HttpCacheMode::USE;
+    m_maxAttempts = 1;
+    m_retryDelay = 250;
+    m_retryMaxDelay = 10000;
+    m_retryBackoff = 2.0;
+    m_retryJitter = 0.5;
+    m_idempotent = false;
+    m_attempts = 0;
+    m_hedge = false;
+    recycleString(m_hedgeProxy);
+    m_submitted = std::chrono::steady_clock::time_point();
+    m_dequeued = std::chrono::steady_clock::time_point();
+    m_sink.reset();
+    m_mpscNext.store(nullptr, std::memory_order_relaxed);
+}
+
+
+RequestPool::RequestPool() : m_hits(0), m_misses(0) {
+    pthread_mutex_init(&m_mutex, nullptr);
+    /* so that release() never has to allocate while holding the lock */
+    m_free.reserve(NETWORKMANAGER_POOL_LIMIT);
+}
+
+RequestPool::~RequestPool(){
+    trim();
+    pthread_mutex_destroy(&m_mutex);
+}
+
+RequestPool* RequestPool::shared(){
+    /* leaked on purpose, see the header */
+    static RequestPool* pool = new RequestPool();
+    return pool;
+}
+
+HttpRequest* RequestPool::acquire(){
+    pthread_mutex_lock(&m_mutex);
+    if (!m_free.empty()){
+        HttpRequest* request = m_free.back();
+        m_free.pop_back();
+        pthread_mutex_unlock(&m_mutex);
+        m_hits++;
+        return request;
+    }
+    pthread_mutex_unlock(&m_mutex);
+    m_misses++;
+    return new HttpRequest;
+}
+
+void RequestPool::release(HttpRequest* request){
+    if (request == nullptr)
+        return;
+    /* wipe it outside of the lock, nobody else can see it yet */
+    request->recycle();
+    pthread_mutex_lock(&m_mutex);
+    if (m_free.size() < NETWORKMANAGER_POOL_LIMIT){
+        m_free.push_back(request);
+        pthread_mutex_unlock(&m_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&m_mutex);
+    delete request;
+}
+
+void RequestPool::trim(){
+    pthread_mutex_lock(&m_mutex);
+    for (size_t i = 0; i < m_free.size(); i++)
+        delete m_free[i];
+    m_free.clear();
+    pthread_mutex_unlock(&m_mutex);
+}
+
+void RequestRecycler::operator()(HttpRequest* request) const {
+    RequestPool::shared()->release(request);
+}
+
+
+BufferPool::BufferPool() : m_bytes(0), m_maxBytes(64 * 1024 * 1024), m_hits(0), m_misses(0) {
+    for (int i = 0; i < BUFFERPOOL_CLASSES; i++)
+        pthread_mutex_init(&m_locks[i], nullptr);
+}
+
+BufferPool::~BufferPool(){
+    for (int i = 0; i < BUFFERPOOL_CLASSES; i++)
+        pthread_mutex_destroy(&m_locks[i]);
+}
+
+BufferPool* BufferPool::shared(){
+    /* leaked on purpose, see the header */
+    static BufferPool* pool = new BufferPool();
+    return pool;
+}
+
+std::string BufferPool::acquire(size_t capacity){
+    int shift = BUFFERPOOL_MIN_SHIFT;
+    while (shift <= BUFFERPOOL_MAX_SHIFT && ((size_t)1 << shift) < capacity)
+        shift++;
+
+    if (shift <= BUFFERPOOL_MAX_SHIFT){
+        int index = shift - BUFFERPOOL_MIN_SHIFT;
+        pthread_mutex_lock(&m_locks[index]);
+        if (!m_classes[index].empty()){
+            /* last one in is the one most likely to still be in cache */
+            std::string buffer;
+            buffer.swap(m_classes[index].back().buffer);
+            m_classes[index].pop_back();
+            pthread_mutex_unlock(&m_locks[index]);
+            m_bytes -= buffer.capacity();
+            m_hits++;
+            return buffer;
+        }
+        pthread_mutex_unlock(&m_locks[index]);
+        /* round up to the class so that it fits back into the same one later */
+        capacity = (size_t)1 << shift;
+    }
+
+    m_misses++;
+    std::string buffer;
+    buffer.reserve(capacity);
+    return buffer;
+}
+
+void BufferPool::release(std::string &buffer){
+    size_t capacity = buffer.capacity();
+    if (capacity < ((size_t)1 << BUFFERPOOL_MIN_SHIFT))
+        return;
+    if (capacity > ((size_t)1 << BUFFERPOOL_MAX_SHIFT) || m_bytes + capacity > m_maxBytes){
+        std::string().swap(buffer);
+        return;
+    }
+
+    /* the biggest class it can fully serve */
+    int shift = BUFFERPOOL_MIN_SHIFT;
+    while (shift < BUFFERPOOL_MAX_SHIFT && ((size_t)1 << (shift + 1)) <= capacity)
+        shift++;
+    int index = shift - BUFFERPOOL_MIN_SHIFT;
+
+    Entry entry;
+    entry.buffer.swap(buffer);
+    entry.buffer.clear();
+    entry.returned = std::chrono::steady_clock::now();
+    m_bytes += capacity;
+
+    pthread_mutex_lock(&m_locks[index]);
+    m_classes[index].push_back(std::move(entry));
+    pthread_mutex_unlock(&m_locks[index]);
+}
+
+void BufferPool::trim(int32_t maxIdle){
+    auto cutoff = std::chrono::steady_clock::now() - std::chrono::seconds(maxIdle);
+    for (int i = 0; i < BUFFERPOOL_CLASSES; i++){
+        pthread_mutex_lock(&m_locks[i]);
+        std::vector<Entry> &bucket = m_classes[i];
+        /* oldest entries sit at the front */
+        size_t stale = 0;
+        while (stale < bucket.size() && (maxIdle <= 0 || bucket[stale].returned < cutoff)){
+            m_bytes -= bucket[stale].buffer.capacity();
+            stale++;
+        }
+        bucket.erase(bucket.begin(), bucket.begin() + stale);
+        pthread_mutex_unlock(&m_locks[i]);
+    }
 }
 
 
 size_t HttpResponse::write_callback(void *data, size_t size, size_t nmemb, void *clientp){
     size_t realsize = size * nmemb;
     HttpResponse* response = reinterpret_cast<HttpResponse*>(clientp);
-    response->data.append(reinterpret_cast<const char*>(data), realsize);
-    return realsize;
+    /* servers that don't send a Content-Length (or lie about it) still get held to the cap */
+    uint64_t cap = response->getRequest()->getMaxBodySize();
+    response->m_received += realsize;
+    if (cap > 0 && response->m_received > cap)
+        return 0;
+
+    ResponseSink* sink = response->getRequest()->getSink();
+    bool ok;
+    /* nothing may throw back through curl's C code, a body we can't find the memory for just fails the transfer */
+    try {
+        if (sink != nullptr)
+            ok = sink->write(response, reinterpret_cast<const char*>(data), realsize);
+        else
+            ok = MemorySink().write(response, reinterpret_cast<const char*>(data), realsize);
+    } catch (const std::bad_alloc&){
+        ok = false;
+    }
+    /* anything short of realsize makes curl abort with CURLE_WRITE_ERROR */
+    return ok ? realsize : 0;
 }
 
 
+/* case-insensitive check for `name` at the start of a header line, returns where the value starts or nullptr */
+static const char* headerValue(const char* line, size_t length, const char* name){
+    size_t nameLength = strlen(name);
+    if (length <= nameLength || line[nameLength] != ':')
+        return nullptr;
+    for (size_t i = 0; i < nameLength; i++){
+        if (tolower(static_cast<unsigned char>(line[i])) != name[i])
+            return nullptr;
+    }
+    const char* value = line + nameLength + 1;
+    while (value < line + length && (*value == ' ' || *value == '\t'))
+        value++;
+    return value;
+}
 
-void* NetQueue::RaiiThread(void *args){
+/* trims the \r\n (and any other trailing whitespace) off a header value */
+static std::string headerString(const char* value, const char* end){
+    while (end > value && isspace(static_cast<unsigned char>(end[-1])))
+        end--;
+    return std::string(value, end - value);
+}
 
-    NetQueue* netq = reinterpret_cast<NetQueue*>(args);
-    
-    while (true){
-        /* TODO: add Condition variable to netq->resquestQueue ? */
-        /* daemon check */
-        if (netq->ShouldCloseDaemon())
-            break;
-        
-        netq->requestQueue.lock();
-        if (!netq->requestQueue.empty()){
-            HttpRequest* request = netq->requestQueue.get();
-            netq->requestQueue.unlock();
-
-            HttpResponse* response = new HttpResponse();
-            /* TODO Copy Request off if there's a problem with queues popping values */
-            response->setRequest(request);
-            
-            switch (request->getRequestType()) {
-                case HttpType::GET: {
-                    response->success = sendGetRequest(response->getRequest(), response);
-                    break;
-                }
+size_t HttpResponse::header_callback(char *buffer, size_t size, size_t nitems, void *clientp){
+    size_t realsize = size * nitems;
+    HttpResponse* response = reinterpret_cast<HttpResponse*>(clientp);
+    const char* end = buffer + realsize;
+    const char* value;
 
-                default: /* HttpType::Post */
-                    response->success = sendPostRequest(response->getRequest(), response);
-                    break;
+    if (realsize > 5 && memcmp(buffer, "HTTP/", 5) == 0){
+        /* a new status line, so anything we saw belonged to an interim response (like 100 Continue) */
+        response->contentLength = -1;
+        response->contentType.clear();
+        response->contentEncoding.clear();
+        response->etag.clear();
+        response->lastModified.clear();
+        response->cacheControl.clear();
+        response->retryAfter = -1;
+    } else if ((value = headerValue(buffer, realsize, "content-length")) != nullptr){
+        int64_t length = 0;
+        int digits = 0;
+        for (; value < end && isdigit(static_cast<unsigned char>(*value)); value++){
+            /* 18 digits always fits in an int64_t, anything longer is nonsense so it's treated like no length at all */
+            if (++digits > 18)
+                break;
+            length = length * 10 + (*value - '0');
+        }
+        if (digits > 0 && digits <= 18)
+            response->contentLength = length;
+    } else if ((value = headerValue(buffer, realsize, "content-type")) != nullptr){
+        response->contentType = headerString(value, end);
+    } else if ((value = headerValue(buffer, realsize, "content-encoding")) != nullptr){
+        response->contentEncoding = headerString(value, end);
+    } else if ((value = headerValue(buffer, realsize, "etag")) != nullptr){
+        response->etag = headerString(value, end);
+    } else if ((value = headerValue(buffer, realsize, "last-modified")) != nullptr){
+        response->lastModified = headerString(value, end);
+    } else if ((value = headerValue(buffer, realsize, "cache-control")) != nullptr){
+        response->cacheControl = headerString(value, end);
+        for (size_t i = 0; i < response->cacheControl.size(); i++)
+            response->cacheControl[i] = static_cast<char>(tolower(static_cast<unsigned char>(response->cacheControl[i])));
+    } else if ((value = headerValue(buffer, realsize, "retry-after")) != nullptr){
+        std::string after = headerString(value, end);
+        if (!after.empty() && isdigit(static_cast<unsigned char>(after[0]))){
+            response->retryAfter = static_cast<int32_t>(strtol(after.c_str(), nullptr, 10));
+        } else {
+            /* it can also be an HTTP-date */
+            time_t when = curl_getdate(after.c_str(), nullptr);
+            time_t now = time(nullptr);
+            if (when != -1)
+                response->retryAfter = when > now ? static_cast<int32_t>(when - now) : 0;
+        }
+    } else if (realsize <= 2 && response->contentLength >= 0){
+        /* the blank line, headers are done and the body is next */
+        uint64_t cap = response->getRequest()->getMaxBodySize();
+        if (cap > 0 && static_cast<uint64_t>(response->contentLength) > cap)
+            /* don't bother downloading something we're going to throw away */
+            return 0;
+        if (response->getRequest()->getSink() == nullptr){
+            try {
+                if (!response->reserveBody(static_cast<size_t>(response->contentLength)))
+                    return 0;
+            } catch (const std::bad_alloc&){
+                return 0;
             }
+        }
+    }
+    return realsize;
+}
 
-            netq->requestQueue.lock();
-            netq->requestQueue.pop();
-            netq->requestQueue.unlock();
 
-            netq->responseQueue.lock();
-            netq->responseQueue.put(response);
-            netq->responseQueue.unlock();
+bool MemorySink::write(HttpResponse* resp, const char* data, size_t size){
+    return resp->appendBody(data, size);
+}
 
-        } else {
-            netq->requestQueue.unlock();
+
+/* An anonymous temp file that gets deleted as soon as it's closed, written while 
+ * the body downloads and then mapped read-only once it's complete */
+class SpillFile {
+#ifdef _WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
+#else
+    int m_fd;
+#endif
+    char* m_view;
+    size_t m_size;
+
+public:
+#ifdef _WIN32
+    SpillFile() : m_file(INVALID_HANDLE_VALUE), m_mapping(nullptr), m_view(nullptr), m_size(0) {}
+#else
+    SpillFile() : m_fd(-1), m_view(nullptr), m_size(0) {}
+#endif
+
+    bool open(){
+#ifdef _WIN32
+        char dir[MAX_PATH + 1];
+        char path[MAX_PATH + 1];
+        DWORD length = GetTempPathA(sizeof(dir), dir);
+        if (length == 0 || length > sizeof(dir) || GetTempFileNameA(dir, "nm", 0, path) == 0)
+            return false;
+        /* DELETE_ON_CLOSE cleans up after us even if the app crashes */
+        m_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, 
+                    FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE){
+            DeleteFileA(path);
+            return false;
+        }
+        return true;
+#else
+        const char* dir = getenv("TMPDIR");
+        std::string path = std::string(dir != nullptr && *dir != '\0' ? dir : "/tmp") + "/networkmanager-XXXXXX";
+        m_fd = mkstemp(&path[0]);
+        if (m_fd < 0)
+            return false;
+        /* unlinked right away, the file lives on only for as long as we hold onto it */
+        unlink(path.c_str());
+        return true;
+#endif
+    }
+
+    bool write(const char* data, size_t size){
+        while (size > 0){
+#ifdef _WIN32
+            DWORD wrote = 0;
+            DWORD chunk = size > 0x40000000 ? 0x40000000 : static_cast<DWORD>(size);
+            if (!WriteFile(m_file, data, chunk, &wrote, nullptr))
+                return false;
+#else
+            ssize_t wrote = ::write(m_fd, data, size);
+            if (wrote < 0){
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+#endif
+            data += wrote;
+            size -= wrote;
+            m_size += wrote;
         }
+        return true;
     }
 
-    /* wake-up the main-thread to drain out all of our queues */
-    netq->mayclose.broadcast();
-    return nullptr;
+    bool map(){
+        /* nothing to map, an empty view is fine */
+        if (m_size == 0)
+            return true;
+#ifdef _WIN32
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_mapping == nullptr)
+            return false;
+        m_view = reinterpret_cast<char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+        return m_view != nullptr;
+#else
+        void* view = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, m_fd, 0);
+        if (view == MAP_FAILED)
+            return false;
+        m_view = reinterpret_cast<char*>(view);
+        /* the mapping keeps the file alive on its own */
+        close(m_fd);
+        m_fd = -1;
+        return true;
+#endif
+    }
+
+    const char* data() const {return m_view;}
+    size_t size() const {return m_view != nullptr ? m_size : 0;}
+
+    ~SpillFile(){
+#ifdef _WIN32
+        if (m_view != nullptr)
+            UnmapViewOfFile(m_view);
+        if (m_mapping != nullptr)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+#else
+        if (m_view != nullptr)
+            munmap(m_view, m_size);
+        if (m_fd >= 0)
+            close(m_fd);
+#endif
+    }
+};
+
+
+HttpResponse::~HttpResponse(){
+    m_request.reset();
+    /* our body buffer goes back to the pool for the next response */
+    BufferPool::shared()->release(data);
 }
 
+BodyView HttpResponse::body() const {
+    if (m_spill != nullptr)
+        return BodyView(m_spill->data(), m_spill->size());
+    if (m_sharedBody != nullptr)
+        return BodyView(m_sharedBody->data(), m_sharedBody->size());
+    return BodyView(data.data(), data.size());
+}
 
-void NetQueue::init(){
-    pthread_t tid;
-    pthread_create(&tid, nullptr, NetQueue::RaiiThread, reinterpret_cast<void*>(this));
-    /* treat tid as a daemon */
-    pthread_detach(tid);
+/* the last response holding onto a shared body gives its buffer back to the pool */
+static void releaseSharedBody(std::string* body){
+    BufferPool::shared()->release(*body);
+    delete body;
 }
 
-void NetQueue::send(HttpRequest* req){
-    /* sendoff our http request */
-    requestQueue.lock();
-    requestQueue.put(req);
-    requestQueue.unlock();
+void HttpResponse::shareBody(HttpResponse* other){
+    if (m_spill == nullptr && m_sharedBody == nullptr){
+        std::string* shared = new std::string();
+        shared->swap(data);
+        m_sharedBody.reset(shared, releaseSharedBody);
+    }
+    other->m_spill = m_spill;
+    other->m_sharedBody = m_sharedBody;
+    other->m_received = m_received;
+    other->success = success;
+    other->status = status;
+    other->curlCode = curlCode;
+    other->error = error;
+    other->attempts = attempts;
+    other->contentLength = contentLength;
+    other->contentType = contentType;
+    other->contentEncoding = contentEncoding;
+    other->etag = etag;
+    other->lastModified = lastModified;
+    other->cacheControl = cacheControl;
+    other->retryAfter = retryAfter;
+    other->cached = cached;
 }
 
-/* used to signal that we may need to close the Daemon */
-bool NetQueue::ShouldCloseDaemon(){
-    m_close.lock();
-    if (m_close == true){
-        m_close.unlock();
+std::string HttpResponse::takeData(){
+    std::string taken;
+    if (m_spill != nullptr || m_sharedBody != nullptr)
+        return body().str();
+    taken.swap(data);
+    return taken;
+}
+
+/* the most reserveBody() sets aside up front, a bigger body grows past it as it actually arrives so 
+ * a server that lies about Content-Length can't make us allocate gigabytes before sending anything */
+#define HTTPRESPONSE_RESERVE_LIMIT (4 * 1024 * 1024)
+
+bool HttpResponse::reserveBody(size_t size){
+    /* only worth doing before anything has been written */
+    if (m_spill != nullptr || !data.empty() || size <= data.capacity())
         return true;
+    if (m_spillThreshold > 0 && size > m_spillThreshold){
+        m_spill.reset(new SpillFile());
+        return m_spill->open();
     }
-    m_close.unlock();
-    return false;
+    if (size > HTTPRESPONSE_RESERVE_LIMIT)
+        size = HTTPRESPONSE_RESERVE_LIMIT;
+    if (size <= data.capacity())
+        return true;
+    BufferPool::shared()->release(data);
+    data = BufferPool::shared()->acquire(size);
+    return true;
 }
 
-/* signal to have the http thread shutdown */
-void NetQueue::CloseDaemon(){
-    m_close.lock();
-    m_close.setValue(true);
-    m_close.unlock();
+bool HttpResponse::appendBody(const char* chunk, size_t size){
+    if (m_spill != nullptr)
+        return m_spill->write(chunk, size);
+
+    size_t needed = data.size() + size;
+    if (m_spillThreshold > 0 && needed > m_spillThreshold){
+        /* too big to keep around in memory, move what we have so far over to disk */
+        m_spill.reset(new SpillFile());
+        if (!m_spill->open() || !m_spill->write(data.data(), data.size()))
+            return false;
+        BufferPool::shared()->release(data);
+        return m_spill->write(chunk, size);
+    }
+
+    if (needed > data.capacity()){
+        /* grow into a pooled buffer instead of letting std::string reallocate on its own */
+        size_t doubled = data.capacity() * 2;
+        std::string bigger = BufferPool::shared()->acquire(needed > doubled ? needed : doubled);
+        bigger.append(data);
+        BufferPool::shared()->release(data);
+        data.swap(bigger);
+    }
+    data.append(chunk, size);
+    return true;
+}
+
+bool HttpResponse::sealBody(){
+    return m_spill == nullptr || m_spill->map();
+}
+
+
+FileSink::FileSink(const std::string &path, size_t bufferSize) : m_path(path), m_file(nullptr), m_buffer(bufferSize > 0 ? bufferSize : 1), m_used(0), m_written(0) {}
+
+FileSink::~FileSink(){
+    if (m_file != nullptr)
+        fclose(m_file);
+}
+
+bool FileSink::flush(){
+    if (m_used == 0)
+        return true;
+    if (fwrite(m_buffer.data(), 1, m_used, m_file) != m_used)
+        return false;
+    m_written += m_used;
+    m_used = 0;
+    return true;
+}
+
+bool FileSink::write(HttpResponse* /*resp*/, const char* data, size_t size){
+    if (m_file == nullptr){
+        /* we do our own buffering */
+        m_file = fopen(m_path.c_str(), "wb");
+        if (m_file == nullptr)
+            return false;
+        setvbuf(m_file, nullptr, _IONBF, 0);
+    }
+    while (size > 0){
+        size_t room = m_buffer.size() - m_used;
+        if (room == 0){
+            if (!flush())
+                return false;
+            room = m_buffer.size();
+        }
+        size_t n = size < room ? size : room;
+        memcpy(m_buffer.data() + m_used, data, n);
+        m_used += n;
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool FileSink::finish(HttpResponse* /*resp*/, bool success){
+    if (success && m_file == nullptr){
+        /* an empty body is still a file */
+        m_file = fopen(m_path.c_str(), "wb");
+        if (m_file == nullptr)
+            return false;
+    }
+    bool flushed = m_file == nullptr || flush();
+    if (m_file != nullptr){
+        flushed = (fclose(m_file) == 0) && flushed;
+        m_file = nullptr;
+    }
+    if (!(success && flushed)){
+        /* don't leave a half written file or an error page behind */
+        remove(m_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+
+/* lets the request's sink close up shop (or maps a spilled body) before the response heads off to the main-thread */
+static void finishSink(HttpResponse* response){
+    ResponseSink* sink = response->getRequest()->getSink();
+    if (sink != nullptr)
+        response->success = sink->finish(response, response->success);
+    else if (!response->sealBody())
+        response->success = false;
+}
+
+
+/* A single in-flight transfer, owned by the daemon while curl_multi drives it */
+struct Transfer {
+    Curl curl;
+    HttpResponse* response;
+    /* index inside of the daemon's in-flight list */
+    size_t slot;
+    /* the other copy of a hedged request while both are running, hedge is set on the second copy */
+    Transfer* twin;
+    bool hedge;
+    std::chrono::steady_clock::time_point started;
+    /* when the second copy goes out if we still haven't heard anything, time_point::max() for never */
+    std::chrono::steady_clock::time_point hedgeAt;
+
+    Transfer(HttpRequest* request, CURL* handle) : curl(handle), response(new HttpResponse()), slot(0), 
+        twin(nullptr), hedge(false), started(std::chrono::steady_clock::now()), hedgeAt(std::chrono::steady_clock::time_point::max()) {
+        response->setRequest(request);
+    }
+
+    /* only used when the daemon is torn down with transfers still running */
+    ~Transfer(){
+        delete response;
+    }
+
+    /* one of these is made for every request so they get recycled too, anything bigger (a subclass) goes straight to the allocator */
+    static void* operator new(size_t size){
+        return size == sizeof(Transfer) ? SlabPool<Transfer>::shared()->allocate() : ::operator new(size);
+    }
+    static void operator delete(void* block, size_t size){
+        if (size == sizeof(Transfer))
+            SlabPool<Transfer>::shared()->deallocate(block);
+        else
+            ::operator delete(block);
+    }
 };
 
-/* shuts down the daemon's lifecycle NOTE: if you set forceShutdown to true you can 
-reduce lag but it may cause problems if there's still http requests running 
-inside the threadpool still... 
-*/
-void NetQueue::shutdown(bool forceShutDown){
-    CloseDaemon();
-    /* Force shutdown blocks the loop Do not attempt to do this unless 
-    you know the requests queue is already empty */
-    if (!forceShutDown){
-        mayclose.lock();
-        mayclose.wait();
-        mayclose.unlock();
+/* pulls the host (and port) out of a url, lowercased so that Boomlings.com and boomlings.com land together */
+static std::string hostOf(const std::string &url){
+    size_t start = url.find("://");
+    start = (start == std::string::npos) ? 0 : start + 3;
+    size_t end = url.find_first_of("/?#", start);
+    std::string host = url.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    /* drop any user:password@ in front */
+    size_t at = host.rfind('@');
+    if (at != std::string::npos)
+        host.erase(0, at + 1);
+    for (size_t i = 0; i < host.size(); i++)
+        host[i] = static_cast<char>(tolower(static_cast<unsigned char>(host[i])));
+    return host;
+}
+
+/* Cloudflare's rate limit page, it doesn't always come with a 429 */
+static bool isRateLimitPage(HttpResponse* response){
+    static const char banned[] = "error code: 1015";
+    BodyView body = response->body();
+    return response->status >= 400 && body.size() >= sizeof(banned) - 1 && memcmp(body.data(), banned, sizeof(banned) - 1) == 0;
+}
+
+static HttpError classify(CURLcode result, HttpResponse* response){
+    switch (result){
+        case CURLE_OK:
+            if (response->status == 429 || isRateLimitPage(response))
+                return HttpError::RATE_LIMITED;
+            if (response->status >= 500)
+                return HttpError::SERVER;
+            if (response->status >= 400)
+                return HttpError::CLIENT;
+            return HttpError::NONE;
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_RESOLVE_PROXY:
+            return HttpError::DNS;
+        case CURLE_COULDNT_CONNECT:
+            return HttpError::CONNECT;
+        case CURLE_OPERATION_TIMEDOUT:
+            return HttpError::TIMEOUT;
+        case CURLE_SSL_CONNECT_ERROR:
+        case CURLE_PEER_FAILED_VERIFICATION:
+        case CURLE_SSL_CERTPROBLEM:
+        case CURLE_SSL_CIPHER:
+        case CURLE_SSL_CACERT_BADFILE:
+        case CURLE_SSL_ISSUER_ERROR:
+        case CURLE_SSL_PINNEDPUBKEYNOTMATCH:
+        case CURLE_SSL_INVALIDCERTSTATUS:
+            return HttpError::TLS;
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+            return HttpError::NETWORK;
+        default:
+            return HttpError::OTHER;
     }
-    
-    threadIsAlive.setValue(false);
-    drainQueue(requestQueue);
-    drainQueue(responseQueue);
-    
 }
 
-NetQueue::~NetQueue(){
-    /* see if we're idle before deciding to force the shutdown however 
-    it is laggy but safe unless the user has already shutdown the threadpool 
-    themselves... */
-    if (threadIsAlive == true){
-        shutdown(responseQueue.empty() && requestQueue.empty());
+/* fills in `response`'s HttpTiming once the daemon is done with it, `curl` is nullptr when the transfer never started */
+static void recordTiming(HttpResponse* response, Curl* curl, std::chrono::steady_clock::time_point now){
+    HttpTiming &timing = response->timing;
+    HttpRequest* request = response->getRequest();
+    timing.submitted = request->getSubmitted();
+    timing.dequeued = request->getDequeued();
+    timing.completed = now;
+    if (curl == nullptr)
+        return;
+
+    /* curl's times all count from the start of the transfer, each one gets turned into how long its own step took. 
+     * Steps that didn't happen are left at 0 by curl, whatever time there was goes to the next one that did */
+    curl_off_t nameLookup = 0, connected = 0, tlsDone = 0, pretransfer = 0, firstByte = 0, total = 0, redirect = 0;
+    curl->getInfo(CURLINFO_NAMELOOKUP_TIME_T, &nameLookup);
+    curl->getInfo(CURLINFO_CONNECT_TIME_T, &connected);
+    curl->getInfo(CURLINFO_APPCONNECT_TIME_T, &tlsDone);
+    curl->getInfo(CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl->getInfo(CURLINFO_STARTTRANSFER_TIME_T, &firstByte);
+    curl->getInfo(CURLINFO_TOTAL_TIME_T, &total);
+    curl->getInfo(CURLINFO_REDIRECT_TIME_T, &redirect);
+    int64_t last = redirect;
+    auto phase = [&](curl_off_t mark) -> int64_t {
+        if (mark <= last)
+            return 0;
+        int64_t took = mark - last;
+        last = mark;
+        return took;
+    };
+    timing.redirect = redirect;
+    timing.dns = phase(nameLookup);
+    timing.connect = phase(connected);
+    timing.tls = phase(tlsDone);
+    timing.wait = phase(firstByte);
+    timing.transfer = phase(total);
+    timing.firstByte = firstByte;
+    timing.total = total;
+
+    long requestSize = 0, headerSize = 0, connects = 0, version = 0;
+    curl_off_t uploaded = 0, downloaded = 0;
+    curl->getInfo(CURLINFO_REQUEST_SIZE, &requestSize);
+    curl->getInfo(CURLINFO_SIZE_UPLOAD_T, &uploaded);
+    curl->getInfo(CURLINFO_HEADER_SIZE, &headerSize);
+    curl->getInfo(CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+    /* a small post body goes out in the same write as the headers and curl counts it in both */
+    timing.bytesSent = requestSize > uploaded ? static_cast<uint64_t>(requestSize) : static_cast<uint64_t>(requestSize) + static_cast<uint64_t>(uploaded);
+    timing.bytesReceived = static_cast<uint64_t>(headerSize) + static_cast<uint64_t>(downloaded);
+    /* nothing had to be opened for it, but it did get as far as sending the request */
+    timing.reused = curl->getInfo(CURLINFO_NUM_CONNECTS, &connects) && connects == 0 && pretransfer > 0;
+
+    curl->getInfo(CURLINFO_HTTP_VERSION, &version);
+    switch (version){
+        case CURL_HTTP_VERSION_1_0: timing.httpVersion = 10; break;
+        case CURL_HTTP_VERSION_1_1: timing.httpVersion = 11; break;
+        case CURL_HTTP_VERSION_2_0: timing.httpVersion = 20; break;
+        case CURL_HTTP_VERSION_3: timing.httpVersion = 30; break;
+        default: timing.httpVersion = 0; break;
     }
-    /* I'll leave up to the compiler on how to destory the other object */
 }
 
+/* how many milliseconds to wait before sending `response`'s request out again, -1 if it's done */
+static int64_t retryDelayMs(HttpResponse* response, std::minstd_rand &rng){
+    HttpRequest* request = response->getRequest();
+    if (request->getAttempts() >= request->getMaxAttempts())
+        return -1;
+    /* a sink already has some of this body, another attempt would mix two bodies together */
+    if (request->getSink() != nullptr && response->getBytesReceived() > 0)
+        return -1;
 
-/* Used to render data and callbacks you setup during your http requests */
-void networkManager::visit(){
-    /* this is a 1 response per frame styled visitation so that lag doesn't occur as frequently */
-    if (hasResponse()){
-        /* lock the queue so that other response objects aren't being removed */
-        m_nq->responseQueue.lock();
-        HttpResponse* resp = getResponse();
-        /* do we have a callback to use? */
-        if (resp->getRequest()->getCallback() != nullptr){
-            responseCallback *cb = resp->getRequest()->getCallback();
-            /* callback to our response */
-            (*cb)(resp);
-        }
-        /* pop out this response */
-        m_nq->responseQueue.pop();
-        m_nq->responseQueue.unlock();
-        /* remove the response now... */
-        delete resp;
+    bool idempotent = request->getRequestType() == HttpType::GET || request->getIdempotent();
+    switch (response->error){
+        /* none of these got as far as the server doing anything */
+        case HttpError::DNS:
+        case HttpError::CONNECT:
+        case HttpError::RATE_LIMITED:
+            break;
+        /* the server may have already acted on these */
+        case HttpError::TIMEOUT:
+        case HttpError::NETWORK:
+        case HttpError::SERVER:
+            if (!idempotent)
+                return -1;
+            break;
+        default:
+            return -1;
+    }
+
+    double delay = request->getRetryDelay() * std::pow(request->getRetryBackoff() > 1.0 ? request->getRetryBackoff() : 1.0, request->getAttempts() - 1);
+    if (request->getRetryMaxDelay() > 0 && delay > request->getRetryMaxDelay())
+        delay = request->getRetryMaxDelay();
+    double jitter = std::min(1.0, std::max(0.0, request->getRetryJitter()));
+    delay *= 1.0 - jitter * std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+    /* the server said how long, waiting any less is a guaranteed rejection */
+    if (response->error == HttpError::RATE_LIMITED && response->retryAfter >= 0)
+        delay = std::max(delay, response->retryAfter * 1000.0);
+    return static_cast<int64_t>(delay);
+}
+
+/* requests a second a throttled host starts back up from when it had no rate limit of its own */
+#define RATELIMIT_FLOOR 0.1
+
+/* a host's responses taking longer than this many times its best round trip (plus the slack, in seconds, 
+ * so a few ms of jitter on a sub-ms host doesn't count) means we're queueing up on it */
+#define HOSTLIMIT_LATENCY_TOLERANCE 2.0
+#define HOSTLIMIT_LATENCY_SLACK 0.005
+
+/* a host that has had nothing going on for this many seconds is forgotten, it starts over the next time it's used */
+#define HOSTLIMIT_IDLE_SECONDS 60
+
+/* getStats() can live with host numbers this old, it keeps the daemon from copying every host on every loop */
+#define HOSTSTATS_INTERVAL_MS 100
+
+/* One host's token bucket plus what the host has told us about how hard we're allowed to hit it, 
+ * and how many transfers it gets at once. That limit is learned with AIMD: it creeps up by one for 
+ * every limit's worth of healthy responses and gets cut on timeouts, 5xx and round trips that blow up */
+struct HostLimit {
+    /* the configured rate, 0 for a host without a RateLimit */
+    double ceiling;
+    /* the rate we're actually going at, 0 while nothing's holding this host back */
+    double rate;
+    double burst;
+    double tokens;
+    std::chrono::steady_clock::time_point refilled;
+    /* nothing goes out to the host before this, set by Retry-After or our own backoff */
+    std::chrono::steady_clock::time_point pausedUntil;
+    std::chrono::steady_clock::time_point lastThrottle;
+    /* throttled responses in a row, the backoff doubles with each one */
+    int32_t strikes;
+    /* roughly how fast we've been sending */
+    double recentRate;
+    /* how fast an unlimited host was going when it first pushed back, it goes back to unlimited once we're there again */
+    double resumeRate;
+    std::chrono::steady_clock::time_point countedSince;
+    int32_t counted;
+    /* requests waiting for a token or a free slot, one queue per lane so they keep their priority while they wait */
+    std::deque<HttpRequest*> held[HTTP_PRIORITY_LANES];
+
+    /* how many transfers the host may have going at once and how many it has, maxLimit is 0 when it's not limited */
+    double limit;
+    int32_t maxLimit;
+    int32_t inFlight;
+    /* time to first byte, the best we've seen (it slowly forgets) and a smoothed average in seconds */
+    double minRtt;
+    double srtt;
+    std::chrono::steady_clock::time_point lastDecrease;
+    /* the last time a transfer to the host started or finished */
+    std::chrono::steady_clock::time_point lastUsed;
+
+    HostLimit(double configuredRate, int32_t configuredBurst, int32_t initialLimit, int32_t maxConcurrency, std::chrono::steady_clock::time_point now) : 
+        ceiling(configuredRate > 0 ? configuredRate : 0), rate(ceiling), burst(configuredBurst > 0 ? configuredBurst : 1), 
+        tokens(burst), refilled(now), pausedUntil(now), lastThrottle(now), strikes(0), recentRate(0), resumeRate(0), countedSince(now), counted(0), 
+        limit(std::min(initialLimit, maxConcurrency)), maxLimit(initialLimit > 0 ? maxConcurrency : 0), inFlight(0), minRtt(0), srtt(0), lastDecrease(now), lastUsed(now) {}
+
+    /* interactive requests get to go past the limit, they're what the reserved slots are for */
+    bool hasRoom(bool interactive) const {
+        return interactive || maxLimit <= 0 || inFlight < std::max(1, static_cast<int32_t>(limit));
+    }
+
+    /* a transfer to this host is done, `rtt` is its time to first byte or 0 if it never got that far */
+    void finished(std::chrono::steady_clock::time_point now, bool failed, double rtt){
+        inFlight--;
+        lastUsed = now;
+        if (maxLimit <= 0)
+            return;
+        if (rtt > 0){
+            /* the baseline creeps up towards what we're seeing so it can follow a host that got slower for good */
+            minRtt = (minRtt <= 0 || rtt < minRtt) ? rtt : minRtt + (rtt - minRtt) * 0.01;
+            srtt = srtt <= 0 ? rtt : srtt * 0.875 + rtt * 0.125;
+        }
+        /* every response from one overloaded moment says the same thing, only back off once per round trip */
+        bool mayDecrease = std::chrono::duration<double>(now - lastDecrease).count() > srtt;
+        if (failed){
+            if (mayDecrease){
+                limit = std::max(1.0, limit * 0.5);
+                lastDecrease = now;
+            }
+        } else if (srtt > minRtt * HOSTLIMIT_LATENCY_TOLERANCE + HOSTLIMIT_LATENCY_SLACK){
+            if (mayDecrease){
+                limit = std::max(1.0, limit * 0.9);
+                lastDecrease = now;
+            }
+        } else if (rtt > 0){
+            limit = std::min(static_cast<double>(maxLimit), limit + 1.0 / limit);
+        }
+    }
+
+    void refill(std::chrono::steady_clock::time_point now){
+        double elapsed = std::chrono::duration<double>(now - refilled).count();
+        refilled = now;
+        if (rate <= 0)
+            return;
+        /* speed back up by a quarter for every second the host has gone without pushing back */
+        double sinceThrottle = std::chrono::duration<double>(now - lastThrottle).count();
+        if (sinceThrottle > 1.0 && (ceiling <= 0 || rate < ceiling)){
+            rate *= std::pow(1.25, elapsed);
+            if (ceiling > 0 && rate > ceiling)
+                rate = ceiling;
+            else if (ceiling <= 0 && rate >= resumeRate){
+                rate = 0;
+                strikes = 0;
+                return;
+            }
+        }
+        tokens = std::min(burst, tokens + elapsed * rate);
+    }
+
+    /* takes a token and a slot if there's one of each to take */
+    bool take(std::chrono::steady_clock::time_point now, bool interactive){
+        if (!hasRoom(interactive) || now < pausedUntil)
+            return false;
+        refill(now);
+        if (rate > 0){
+            if (tokens < 1.0)
+                return false;
+            tokens -= 1.0;
+        }
+        /* keep a rough idea of how fast we've been going */
+        counted++;
+        double window = std::chrono::duration<double>(now - countedSince).count();
+        if (window >= 1.0){
+            recentRate = counted / window;
+            counted = 0;
+            countedSince = now;
+        }
+        inFlight++;
+        lastUsed = now;
+        return true;
+    }
+
+    bool holding() const {
+        for (int lane = 0; lane < HTTP_PRIORITY_LANES; lane++){
+            if (!held[lane].empty())
+                return true;
+        }
+        return false;
+    }
+
+    /* how long until take() could say yes, a host that's out of slots waits on a transfer finishing instead */
+    std::chrono::steady_clock::duration untilReady(std::chrono::steady_clock::time_point now) const {
+        if (!hasRoom(!held[static_cast<int>(HttpPriority::INTERACTIVE)].empty()))
+            return std::chrono::steady_clock::duration::max();
+        if (now < pausedUntil)
+            return pausedUntil - now;
+        if (rate <= 0)
+            return std::chrono::steady_clock::duration::zero();
+        double available = tokens + std::chrono::duration<double>(now - refilled).count() * rate;
+        if (available >= 1.0)
+            return std::chrono::steady_clock::duration::zero();
+        return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>((1.0 - available) / rate));
+    }
+
+    /* the host said slow down, halve the rate and pause for as long as it asked or for our own doubling backoff */
+    void throttle(std::chrono::steady_clock::time_point now, int32_t retryAfter, int32_t maxBackoff){
+        if (now < pausedUntil){
+            /* the rest of a burst that went out before the pause, it's the same push back so only its Retry-After counts */
+            if (retryAfter > 0)
+                pausedUntil = std::max(pausedUntil, now + std::chrono::seconds(maxBackoff > 0 ? std::min(retryAfter, maxBackoff) : retryAfter));
+            return;
+        }
+        refill(now);
+        strikes++;
+        int64_t pause = retryAfter >= 0 ? retryAfter : (int64_t(1) << std::min(strikes - 1, 16));
+        if (maxBackoff > 0 && pause > maxBackoff)
+            pause = maxBackoff;
+        pausedUntil = now + std::chrono::seconds(pause);
+        if (recentRate <= 0)
+            recentRate = counted > 0 ? counted : 1.0;
+        if (rate <= 0 && ceiling <= 0)
+            resumeRate = recentRate;
+        double from = rate > 0 ? rate : recentRate;
+        rate = std::max(RATELIMIT_FLOOR, from / 2);
+        tokens = 0;
+        lastThrottle = now;
+    }
+};
+
+/* daemon only, every host this shard has talked to and the requests their limits are holding back */
+struct HostLimiter {
+    NetQueue* netq;
+    std::vector<RateLimit> rules;
+    std::unordered_map<std::string, HostLimit> hosts;
+    size_t heldCount;
+    /* how many of those came out of each lane */
+    size_t heldIn[HTTP_PRIORITY_LANES];
+    /* something changed since the last publish() */
+    bool dirty;
+    /* the last time evictIdle() went through hosts */
+    std::chrono::steady_clock::time_point swept;
+
+    HostLimiter(NetQueue* owner, const std::vector<RateLimit> &rateLimits) : netq(owner), rules(rateLimits), heldCount(0), heldIn(), dirty(false) {}
+
+    HostLimit &limitFor(const std::string &host, std::chrono::steady_clock::time_point now){
+        auto found = hosts.find(host);
+        if (found != hosts.end())
+            return found->second;
+        /* rules match on the name alone, whatever port the URL used */
+        std::string name = host.substr(0, host.find(':'));
+        const RateLimit* rule = nullptr;
+        for (size_t i = 0; i < rules.size() && rule == nullptr; i++){
+            const std::string &pattern = rules[i].host;
+            if (pattern == "*" || name == pattern || (name.size() > pattern.size() 
+                    && name.compare(name.size() - pattern.size(), pattern.size(), pattern) == 0 
+                    && name[name.size() - pattern.size() - 1] == '.'))
+                rule = &rules[i];
+        }
+        int32_t window = netq->getMaxConcurrency() > 0 ? netq->getMaxConcurrency() : 1;
+        return hosts.emplace(host, HostLimit(rule ? rule->rate : 0, rule ? rule->burst : 1, netq->getHostConcurrency(), window, now)).first->second;
+    }
+
+    /* true if `request` may go out now, otherwise it's held until its host is ready */
+    bool admit(HttpRequest* request, std::chrono::steady_clock::time_point now){
+        HostLimit &limit = limitFor(hostOf(request->getURL()), now);
+        int lane = static_cast<int>(request->getPriority());
+        dirty = true;
+        /* nobody gets to cut in front of requests for the host that are already waiting in this lane or a more urgent one */
+        bool waiting = false;
+        for (int i = 0; i <= lane && !waiting; i++)
+            waiting = !limit.held[i].empty();
+        if (!waiting && limit.take(now, request->getPriority() == HttpPriority::INTERACTIVE))
+            return true;
+        limit.held[lane].push_back(request);
+        heldCount++;
+        heldIn[lane]++;
+        netq->m_rateLimited++;
+        return false;
+    }
+
+    /* takes a slot for a hedge's second copy, which never waits around if the host isn't ready */
+    bool tryTake(HttpRequest* request, std::chrono::steady_clock::time_point now){
+        dirty = true;
+        return limitFor(hostOf(request->getURL()), now).take(now, false);
+    }
+
+    /* gives back the slot of a transfer that got cancelled */
+    void release(HttpRequest* request, std::chrono::steady_clock::time_point now){
+        dirty = true;
+        limitFor(hostOf(request->getURL()), now).inFlight--;
+    }
+
+    /* the next request `lane` has held back whose host is ready for it, or nullptr */
+    HttpRequest* nextHeld(std::chrono::steady_clock::time_point now, int lane){
+        if (heldIn[lane] == 0)
+            return nullptr;
+        bool interactive = lane == static_cast<int>(HttpPriority::INTERACTIVE);
+        for (auto it = hosts.begin(); it != hosts.end(); ++it){
+            HostLimit &limit = it->second;
+            if (limit.held[lane].empty() || !limit.take(now, interactive))
+                continue;
+            HttpRequest* request = limit.held[lane].front();
+            limit.held[lane].pop_front();
+            heldCount--;
+            heldIn[lane]--;
+            dirty = true;
+            return request;
+        }
+        return nullptr;
+    }
+
+    /* Looks a finished response over for the host telling us to back off and gives its slot back. 
+     * `result` is what curl said about the transfer and `rtt` its time to first byte in seconds */
+    void observe(HttpResponse* response, CURLcode result, double rtt, std::chrono::steady_clock::time_point now){
+        HostLimit &limit = limitFor(hostOf(response->getRequest()->getURL()), now);
+        dirty = true;
+        /* a write error is us cutting the transfer off (a body that was too big) and a failed init 
+         * is us not managing to set it up, neither one is the host's fault */
+        bool failed = (result != CURLE_OK && result != CURLE_WRITE_ERROR && result != CURLE_FAILED_INIT) || response->status >= 500;
+        limit.finished(now, failed, rtt);
+
+        bool throttled = response->status == 429 || response->status == 503 || isRateLimitPage(response);
+        if (!throttled){
+            /* the host is happy again, the next push back starts the backoff over */
+            if (response->success)
+                limit.strikes = 0;
+            return;
+        }
+        limit.throttle(now, response->retryAfter, netq->getMaxBackoff());
+        netq->m_throttled++;
+    }
+
+    /* forgets hosts that haven't been used for HOSTLIMIT_IDLE_SECONDS, only looks every so often */
+    void evictIdle(std::chrono::steady_clock::time_point now){
+        if (now - swept < std::chrono::seconds(HOSTLIMIT_IDLE_SECONDS))
+            return;
+        swept = now;
+        for (auto it = hosts.begin(); it != hosts.end();){
+            const HostLimit &limit = it->second;
+            if (limit.inFlight <= 0 && !limit.holding() && now >= limit.pausedUntil 
+                    && now - limit.lastUsed >= std::chrono::seconds(HOSTLIMIT_IDLE_SECONDS)){
+                it = hosts.erase(it);
+                dirty = true;
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    /* how long the daemon can sleep before a held request could go, -1 with nothing held */
+    int untilReadyMs(std::chrono::steady_clock::time_point now) const {
+        if (heldCount == 0)
+            return -1;
+        auto soonest = std::chrono::steady_clock::duration::max();
+        for (auto it = hosts.begin(); it != hosts.end(); ++it){
+            if (it->second.holding())
+                soonest = std::min(soonest, it->second.untilReady(now));
+        }
+        if (soonest == std::chrono::steady_clock::duration::max())
+            return -1;
+        /* round up so we don't wake up a hair too early and go straight back to sleep */
+        return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(soonest).count()) + 1;
+    }
+
+    /* a copy of every host's limits for getStats() */
+    void snapshot(std::vector<HostStats> &out) const {
+        out.clear();
+        for (auto it = hosts.begin(); it != hosts.end(); ++it){
+            HostStats stats;
+            stats.host = it->first;
+            stats.concurrencyLimit = it->second.maxLimit > 0 ? std::max(1, static_cast<int32_t>(it->second.limit)) : 0;
+            stats.inFlight = it->second.inFlight;
+            stats.held = 0;
+            for (int lane = 0; lane < HTTP_PRIORITY_LANES; lane++)
+                stats.held += static_cast<int32_t>(it->second.held[lane].size());
+            stats.rate = it->second.rate;
+            stats.rttMs = it->second.srtt * 1000.0;
+            out.push_back(stats);
+        }
+    }
+
+    /* hands every held request back, the daemon is going away */
+    void clear(){
+        for (auto it = hosts.begin(); it != hosts.end(); ++it){
+            for (int lane = 0; lane < HTTP_PRIORITY_LANES; lane++){
+                for (size_t i = 0; i < it->second.held[lane].size(); i++)
+                    RequestPool::shared()->release(it->second.held[lane][i]);
+                it->second.held[lane].clear();
+            }
+        }
+        heldCount = 0;
+        for (int lane = 0; lane < HTTP_PRIORITY_LANES; lane++)
+            heldIn[lane] = 0;
+    }
+};
+
+/* how many recent first byte times each endpoint keeps, and how many it needs before anything gets hedged */
+#define HEDGE_SAMPLES 64
+#define HEDGE_MIN_SAMPLES 16
+/* past this many endpoints the tracker starts over instead of growing forever */
+#define HEDGE_MAX_ENDPOINTS 256
+/* how many finished hedged requests getStats() looks at for its percentiles, per shard */
+#define HEDGE_LATENCY_WINDOW 1024
+
+static bool hedgeable(HttpRequest* request){
+    return request->getHedge() && request->getSink() == nullptr 
+        && (request->getRequestType() == HttpType::GET || request->getIdempotent());
+}
+
+/* daemon only, recent time to first byte of every endpoint (URL without the query) that has hedged requests */
+struct HedgeTracker {
+    struct Samples {
+        double ms[HEDGE_SAMPLES];
+        size_t next;
+        size_t count;
+    };
+    std::unordered_map<std::string, Samples> endpoints;
+    /* hedged requests started and second copies sent, for the budget */
+    uint64_t started;
+    uint64_t hedges;
+
+    HedgeTracker() : started(0), hedges(0) {}
+
+    static std::string endpointOf(const std::string &url){
+        return url.substr(0, url.find_first_of("?#"));
+    }
+
+    void record(const std::string &url, double ms){
+        std::string endpoint = endpointOf(url);
+        auto found = endpoints.find(endpoint);
+        if (found == endpoints.end()){
+            if (endpoints.size() >= HEDGE_MAX_ENDPOINTS)
+                endpoints.clear();
+            Samples fresh;
+            fresh.next = 0;
+            fresh.count = 0;
+            found = endpoints.emplace(endpoint, fresh).first;
+        }
+        Samples &samples = found->second;
+        samples.ms[samples.next] = ms;
+        samples.next = (samples.next + 1) % HEDGE_SAMPLES;
+        if (samples.count < HEDGE_SAMPLES)
+            samples.count++;
+    }
+
+    /* how long a request to `url` may go without a first byte before it's hedged, -1 if we don't know yet */
+    double threshold(const std::string &url, double percentile) const {
+        auto found = endpoints.find(endpointOf(url));
+        if (found == endpoints.end() || found->second.count < HEDGE_MIN_SAMPLES)
+            return -1;
+        const Samples &samples = found->second;
+        double sorted[HEDGE_SAMPLES];
+        std::copy(samples.ms, samples.ms + samples.count, sorted);
+        size_t rank = static_cast<size_t>(std::min(1.0, std::max(0.0, percentile)) * (samples.count - 1));
+        std::nth_element(sorted, sorted + rank, sorted + samples.count);
+        return sorted[rank];
+    }
+
+    bool withinBudget(double budget) const {
+        return static_cast<double>(hedges + 1) <= budget * static_cast<double>(started);
+    }
+};
+
+/* the p-th percentile of `values`, which gets reordered */
+static double percentileOf(std::vector<double> &values, double p){
+    if (values.empty())
+        return 0;
+    size_t rank = static_cast<size_t>(p * (values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+}
+
+/* a failed request waiting to go out again */
+struct RetryTimer {
+    std::chrono::steady_clock::time_point due;
+    HttpRequest* request;
+
+    bool operator>(const RetryTimer &other) const {return due > other.due;}
+};
+
+struct NetShard {
+    NetQueue* netq;
+    /* one queue per HttpPriority lane, any thread may send(), only this shard's daemon takes requests out */
+    mpscqueue<HttpRequest> requestQueue[HTTP_PRIORITY_LANES];
+    /* daemon only, requests picked by strict priority since a lower lane last got a turn */
+    int32_t sinceBoost;
+    /* daemon only, the lower lane that gets the next turn */
+    int32_t boostLane;
+    /* our reference to the process-wide CurlShare, taken before the multi handle is made 
+     * since acquiring it is what calls curl_global_init and that has to come before anything else */
+    CURLSH* share;
+    /* owned by the shard rather than the daemon so that send() and CloseDaemon() 
+     * can always poke it with curl_multi_wakeup, even while the daemon is starting up */
+    CURLM* multi;
+    /* finished responses on their way to the main-thread, this daemon is the only producer */
+    spscring<HttpResponse*> responses;
+    /* daemon only, responses that didn't fit into the ring yet */
+    std::deque<HttpResponse*> backlog;
+    /* daemon only, per-host rate and concurrency limits and the requests they're holding back */
+    HostLimiter limiter;
+    /* what limiter looked like last time the daemon published it, for getStats() */
+    pthread_mutex_t statsMutex;
+    std::vector<HostStats> hostStats;
+    /* daemon only */
+    std::chrono::steady_clock::time_point published;
+    /* daemon only, retries waiting for their backoff to run out, soonest first */
+    std::priority_queue<RetryTimer, std::vector<RetryTimer>, std::greater<RetryTimer>> retries;
+    /* daemon only, for retry jitter */
+    std::minstd_rand rng;
+    /* daemon only */
+    HedgeTracker hedging;
+    /* start to finish times of the last HEDGE_LATENCY_WINDOW hedged requests, guarded by statsMutex */
+    std::vector<double> hedgedLatency;
+    size_t hedgedNext;
+
+    NetShard(NetQueue* owner, size_t capacity, const std::vector<RateLimit> &rateLimits) : netq(owner), sinceBoost(0), boostLane(0), 
+        share(CurlShare::acquire()), multi(curl_multi_init()), responses(capacity), limiter(owner, rateLimits), 
+        rng(static_cast<std::minstd_rand::result_type>(std::chrono::steady_clock::now().time_since_epoch().count() ^ reinterpret_cast<uintptr_t>(this))), 
+        hedgedNext(0) {
+        pthread_mutex_init(&statsMutex, nullptr);
+    }
+
+    /* daemon only */
+    void recordHedged(double ms){
+        pthread_mutex_lock(&statsMutex);
+        if (hedgedLatency.size() < HEDGE_LATENCY_WINDOW)
+            hedgedLatency.push_back(ms);
+        else
+            hedgedLatency[hedgedNext] = ms;
+        hedgedNext = (hedgedNext + 1) % HEDGE_LATENCY_WINDOW;
+        pthread_mutex_unlock(&statsMutex);
+    }
+
+    /* daemon only, sends `request` out again once `delayMs` have passed */
+    void scheduleRetry(HttpRequest* request, int64_t delayMs){
+        RetryTimer timer;
+        timer.due = std::chrono::steady_clock::now() + std::chrono::milliseconds(delayMs);
+        timer.request = request;
+        retries.push(timer);
+    }
+
+    /* daemon only, a retry whose backoff has run out or nullptr */
+    HttpRequest* dueRetry(std::chrono::steady_clock::time_point now){
+        if (retries.empty() || retries.top().due > now)
+            return nullptr;
+        HttpRequest* request = retries.top().request;
+        retries.pop();
+        return request;
+    }
+
+    /* daemon only, milliseconds until the next retry is due or -1 without any */
+    int untilRetryMs(std::chrono::steady_clock::time_point now) const {
+        if (retries.empty())
+            return -1;
+        if (retries.top().due <= now)
+            return 0;
+        return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(retries.top().due - now).count()) + 1;
+    }
+
+    /* daemon only, copies limiter out for getStats() at most every HOSTSTATS_INTERVAL_MS. Returns 
+     * milliseconds until a change that's still waiting should be published or -1 with nothing waiting */
+    int publishStats(std::chrono::steady_clock::time_point now){
+        if (!limiter.dirty)
+            return -1;
+        auto due = published + std::chrono::milliseconds(HOSTSTATS_INTERVAL_MS);
+        if (now < due)
+            return static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count()) + 1;
+        published = now;
+        pthread_mutex_lock(&statsMutex);
+        limiter.snapshot(hostStats);
+        pthread_mutex_unlock(&statsMutex);
+        limiter.dirty = false;
+        return -1;
+    }
+
+    /* daemon only, the next request out of `lane` whose host is ready for it. What the lane's hosts held back 
+     * goes first, anything else we pull out for a host that isn't ready waits in that host's own held queue. 
+     * The lane can't be stopped early, a paused host would have every other host behind it wait out its backoff */
+    HttpRequest* fromLane(int lane, std::chrono::steady_clock::time_point now){
+        HttpRequest* request = limiter.nextHeld(now, lane);
+        if (request != nullptr)
+            return request;
+        while ((request = requestQueue[lane].pop()) != nullptr){
+            if (limiter.admit(request, now))
+                return request;
+        }
+        return nullptr;
+    }
+
+    /* daemon only, picks the next request to start or returns nullptr when there's nothing 
+     * we're allowed to take. Lanes are strictly ordered except that every starvationLimit 
+     * picks one of the lower lanes (taking turns) gets looked at first */
+    HttpRequest* nextRequest(std::chrono::steady_clock::time_point now, bool interactiveOnly, int32_t starvationLimit){
+        if (interactiveOnly)
+            return fromLane(static_cast<int>(HttpPriority::INTERACTIVE), now);
+
+        if (starvationLimit > 0 && sinceBoost >= starvationLimit){
+            for (int i = 0; i < HTTP_PRIORITY_LANES - 1; i++){
+                boostLane = boostLane % (HTTP_PRIORITY_LANES - 1) + 1;
+                HttpRequest* request = fromLane(boostLane, now);
+                if (request != nullptr){
+                    sinceBoost = 0;
+                    return request;
+                }
+            }
+        }
+
+        for (int lane = 0; lane < HTTP_PRIORITY_LANES; lane++){
+            HttpRequest* request = fromLane(lane, now);
+            if (request != nullptr){
+                sinceBoost++;
+                return request;
+            }
+        }
+        return nullptr;
+    }
+
+    /* daemon only, puts a finished response out for the main-thread to pick up */
+    void deliver(HttpResponse* response){
+        if (!backlog.empty() || !responses.push(response))
+            backlog.push_back(response);
+    }
+
+    /* daemon only, moves whatever the ring has room for out of the backlog, returns true once it's empty */
+    bool flushBacklog(){
+        while (!backlog.empty() && responses.push(backlog.front()))
+            backlog.pop_front();
+        return backlog.empty();
+    }
+
+    /* breaks the daemon out of curl_multi_poll, wakeups stick around until the 
+     * next poll so one that lands before the daemon goes to sleep isn't lost */
+    void wakeup(){
+        if (multi != nullptr)
+            curl_multi_wakeup(multi);
+    }
+
+    ~NetShard(){
+        if (multi != nullptr)
+            curl_multi_cleanup(multi);
+        /* the daemon has already cleaned up every easy handle that used the share */
+        CurlShare::release();
+        pthread_mutex_destroy(&statsMutex);
+    }
+};
+
+/* the ResponseCache is split up into this many independently locked shards */
+#define RESPONSECACHE_SHARDS 16
+
+/* roughly what an entry costs us on top of its body and key */
+#define RESPONSECACHE_ENTRY_OVERHEAD 128
+
+/* 64-bit FNV-1a, used for the post field part of cache keys and for the frequency sketch */
+static uint64_t fnv1a(const char* data, size_t size, uint64_t hash = 14695981039346656037ULL){
+    for (size_t i = 0; i < size; i++){
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* pulls `directive=N` out of a Cache-Control header, -1 when it isn't there */
+static int64_t cacheControlSeconds(const std::string &cacheControl, const char* directive){
+    size_t at = cacheControl.find(directive);
+    if (at == std::string::npos)
+        return -1;
+    at += strlen(directive);
+    if (at >= cacheControl.size() || cacheControl[at] != '=')
+        return -1;
+    int64_t seconds = 0;
+    bool digits = false;
+    for (at++; at < cacheControl.size() && isdigit(static_cast<unsigned char>(cacheControl[at])); at++){
+        seconds = seconds * 10 + (cacheControl[at] - '0');
+        digits = true;
+    }
+    return digits ? seconds : -1;
+}
+
+/* A count-min sketch of how often each key gets asked for, four rows of small saturating counters 
+ * that are all halved every so often so old popularity fades out. This is the "TinyLFU" part */
+struct FrequencySketch {
+    std::vector<uint8_t> counters;
+    size_t mask;
+    size_t additions;
+    size_t sampleSize;
+
+    FrequencySketch(size_t width) : additions(0) {
+        size_t size = 16;
+        while (size < width)
+            size <<= 1;
+        counters.assign(size * 4, 0);
+        mask = size - 1;
+        sampleSize = size * 10;
+    }
+
+    size_t slot(uint64_t hash, int row) const {
+        /* a different multiplier per row gives us four mostly independent hashes out of one */
+        static const uint64_t seeds[4] = {0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL};
+        uint64_t mixed = (hash ^ (hash >> 29)) * seeds[row];
+        return row * (mask + 1) + ((mixed >> 32) & mask);
+    }
+
+    void increment(uint64_t hash){
+        for (int row = 0; row < 4; row++){
+            uint8_t &counter = counters[slot(hash, row)];
+            if (counter < 15)
+                counter++;
+        }
+        if (++additions >= sampleSize){
+            for (size_t i = 0; i < counters.size(); i++)
+                counters[i] >>= 1;
+            additions /= 2;
+        }
+    }
+
+    uint8_t estimate(uint64_t hash) const {
+        uint8_t lowest = 15;
+        for (int row = 0; row < 4; row++){
+            uint8_t counter = counters[slot(hash, row)];
+            if (counter < lowest)
+                lowest = counter;
+        }
+        return lowest;
+    }
+};
+
+struct CacheEntry {
+    std::string body;
+    std::string contentType;
+    std::string etag;
+    std::string lastModified;
+    int status;
+    uint64_t hash;
+    std::chrono::steady_clock::time_point freshUntil;
+    std::chrono::steady_clock::time_point staleUntil;
+    /* a background refresh is already on its way, don't start another */
+    bool revalidating;
+    /* which segment it sits in, the small admission window or the main one */
+    bool inWindow;
+    size_t charge;
+    std::list<const std::string*>::iterator position;
+};
+
+/* One lock's worth of the cache. New entries land in a small LRU window (1% of the shard) and 
+ * whatever falls out of it only makes it into the main LRU if the sketch says it's wanted 
+ * more often than the main segment's own victim, so a flood of one-off requests can't wash out 
+ * the pages people keep coming back to */
+struct CacheShard {
+    pthread_mutex_t mutex;
+    std::unordered_map<std::string, CacheEntry> entries;
+    /* most recently used at the front */
+    std::list<const std::string*> window;
+    std::list<const std::string*> main;
+    size_t windowBytes;
+    size_t mainBytes;
+    size_t windowCapacity;
+    size_t mainCapacity;
+    FrequencySketch sketch;
+
+    CacheShard(size_t capacity) : windowBytes(0), mainBytes(0), sketch(capacity / 1024 > 256 ? capacity / 1024 : 256) {
+        pthread_mutex_init(&mutex, nullptr);
+        windowCapacity = capacity / 100;
+        mainCapacity = capacity - windowCapacity;
+    }
+
+    ~CacheShard(){
+        pthread_mutex_destroy(&mutex);
+    }
+
+    void touch(CacheEntry &entry){
+        std::list<const std::string*> &segment = entry.inWindow ? window : main;
+        segment.splice(segment.begin(), segment, entry.position);
+    }
+
+    void erase(const std::string* key){
+        auto found = entries.find(*key);
+        CacheEntry &entry = found->second;
+        if (entry.inWindow){
+            windowBytes -= entry.charge;
+            window.erase(entry.position);
+        } else {
+            mainBytes -= entry.charge;
+            main.erase(entry.position);
+        }
+        entries.erase(found);
+    }
+
+    /* puts a new entry at the front of the window and lets admission sort out the rest, 
+     * returns the entry or nullptr if it was turned away (or there was no room for it at all) */
+    CacheEntry* insert(const std::string &key, CacheEntry &entry, uint64_t *rejected){
+        auto found = entries.find(key);
+        if (found != entries.end())
+            erase(&found->first);
+        if (entry.charge > mainCapacity)
+            return nullptr;
+        auto inserted = entries.emplace(key, CacheEntry()).first;
+        inserted->second = std::move(entry);
+        inserted->second.inWindow = true;
+        inserted->second.revalidating = false;
+        window.push_front(&inserted->first);
+        inserted->second.position = window.begin();
+        windowBytes += inserted->second.charge;
+        *rejected += admit();
+        found = entries.find(key);
+        return found != entries.end() ? &found->second : nullptr;
+    }
+
+    /* moves whatever the window can't hold over to the main segment, returns how many got turned away */
+    uint64_t admit(){
+        uint64_t rejected = 0;
+        while (windowBytes > windowCapacity && !window.empty()){
+            const std::string* candidateKey = window.back();
+            CacheEntry &candidate = entries.find(*candidateKey)->second;
+            window.pop_back();
+            windowBytes -= candidate.charge;
+
+            /* the candidate has to be wanted more than everything it would push out */
+            bool admitted = candidate.charge <= mainCapacity;
+            uint8_t frequency = sketch.estimate(candidate.hash);
+            while (admitted && mainBytes + candidate.charge > mainCapacity){
+                const std::string* victimKey = main.back();
+                if (sketch.estimate(entries.find(*victimKey)->second.hash) >= frequency){
+                    admitted = false;
+                    break;
+                }
+                erase(victimKey);
+            }
+
+            if (!admitted){
+                entries.erase(*candidateKey);
+                rejected++;
+                continue;
+            }
+            candidate.inWindow = false;
+            main.push_front(candidateKey);
+            candidate.position = main.begin();
+            mainBytes += candidate.charge;
+        }
+        return rejected;
+    }
+};
+
+/* A file of a fixed size mapped read/write, used for the disk cache's index */
+class MappedFile {
+#ifdef _WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
+#else
+    int m_fd;
+#endif
+    char* m_view;
+    size_t m_size;
+
+public:
+#ifdef _WIN32
+    MappedFile() : m_file(INVALID_HANDLE_VALUE), m_mapping(nullptr), m_view(nullptr), m_size(0) {}
+#else
+    MappedFile() : m_fd(-1), m_view(nullptr), m_size(0) {}
+#endif
+    ~MappedFile(){close();}
+
+    /* opens (or creates) path and maps it, a file that isn't `size` bytes yet gets zero-filled up to it */
+    bool open(const std::string &path, size_t size){
+        close();
+#ifdef _WIN32
+        m_file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE)
+            return false;
+        m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READWRITE, static_cast<DWORD>(static_cast<uint64_t>(size) >> 32), static_cast<DWORD>(size), nullptr);
+        if (m_mapping == nullptr){
+            close();
+            return false;
+        }
+        m_view = reinterpret_cast<char*>(MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size));
+#else
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (m_fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(m_fd, &info) != 0 || (static_cast<size_t>(info.st_size) != size && ftruncate(m_fd, size) != 0)){
+            close();
+            return false;
+        }
+        void* view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+        m_view = view == MAP_FAILED ? nullptr : reinterpret_cast<char*>(view);
+#endif
+        if (m_view == nullptr){
+            close();
+            return false;
+        }
+        m_size = size;
+        return true;
+    }
+
+    /* pushes our changes out to the file */
+    void flush(){
+        if (m_view == nullptr)
+            return;
+#ifdef _WIN32
+        FlushViewOfFile(m_view, m_size);
+#else
+        msync(m_view, m_size, MS_ASYNC);
+#endif
+    }
+
+    void close(){
+#ifdef _WIN32
+        if (m_view != nullptr)
+            UnmapViewOfFile(m_view);
+        if (m_mapping != nullptr)
+            CloseHandle(m_mapping);
+        if (m_file != INVALID_HANDLE_VALUE)
+            CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+        m_mapping = nullptr;
+#else
+        if (m_view != nullptr)
+            munmap(m_view, m_size);
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+#endif
+        m_view = nullptr;
+        m_size = 0;
+    }
+
+    char* data() const {return m_view;}
+    size_t size() const {return m_size;}
+};
+
+#ifdef _WIN32
+#define NM_FSEEK _fseeki64
+#define NM_FTELL _ftelli64
+#else
+#define NM_FSEEK fseeko
+#define NM_FTELL ftello
+#endif
+
+/* bump these whenever the layout of the files below changes, old files just get thrown away */
+#define DISKCACHE_INDEX_MAGIC 0x4E4D4958u
+#define DISKCACHE_RECORD_MAGIC 0x4E4D5245u
+#define DISKCACHE_VERSION 1
+
+/* how many jobs the disk worker may have waiting, past that reads go straight to the network and stores get dropped */
+#define DISKCACHE_MAX_PENDING 1024
+
+struct DiskIndexHeader {
+    uint32_t magic;
+    uint32_t version;
+    /* which data.<generation>.log the offsets below point into */
+    uint64_t generation;
+    uint64_t capacity;
+    uint64_t count;
+};
+
+/* hash 0 marks an empty slot */
+struct DiskIndexSlot {
+    uint64_t hash;
+    uint64_t offset;
+    uint64_t length;
+};
+
+/* written in front of every record in the log, followed by the key, content type, etag, last-modified and the body */
+struct DiskRecordHeader {
+    uint32_t magic;
+    /* over everything after the header, a torn write at the end of the log never matches */
+    uint32_t checksum;
+    int32_t status;
+    uint32_t keyLength;
+    uint64_t bodyLength;
+    /* unix time in milliseconds, steady_clock doesn't survive a restart */
+    int64_t freshUntil;
+    int64_t staleUntil;
+    uint16_t contentTypeLength;
+    uint16_t etagLength;
+    uint16_t lastModifiedLength;
+    uint16_t reserved;
+};
+
+/* one thing for the disk worker to do, read back the record `request` is after or store `entry` when there's no request */
+struct DiskJob {
+    HttpRequest* request;
+    std::string key;
+    uint64_t hash;
+    CacheEntry entry;
+};
+
+static int64_t unixMillis(){
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+/* The ResponseCache's second tier. Records only ever get appended to data.<generation>.log and 
+ * index.bin is a memory-mapped open addressing table of key hash to record, so opening it 
+ * costs nothing no matter how much is in there. A crash can at worst leave a record that the 
+ * index never got to point at, or one whose checksum doesn't match, and both just read as a miss. 
+ * Once the log outgrows its cap (or the index fills up) the newest records get copied into the 
+ * next generation and index.bin is swapped over with a rename. All of the reading, writing and 
+ * compacting happens on the cache's own worker (NetQueue::DiskThread) so send() and the daemons 
+ * only ever hand it jobs */
+struct DiskCache {
+    std::string dir;
+    size_t capacity;
+    pthread_mutex_t mutex;
+    MappedFile index;
+    FILE* log;
+    uint64_t logSize;
+    std::atomic<bool> needsCompaction;
+    std::atomic<uint64_t> diskHits;
+    std::atomic<uint64_t> diskBytes;
+    /* pending and stopping are guarded by the queue's lock */
+    mcqueue<DiskJob*> jobs;
+    size_t pending;
+    bool stopping;
+    pthread_t worker;
+    bool started;
+
+    DiskCache(const std::string &directory, size_t cap) : dir(directory), capacity(cap), log(nullptr), logSize(0), 
+        needsCompaction(false), diskHits(0), diskBytes(0), pending(0), stopping(false), started(false) {
+        pthread_mutex_init(&mutex, nullptr);
+#ifdef _WIN32
+        CreateDirectoryA(dir.c_str(), nullptr);
+#else
+        mkdir(dir.c_str(), 0755);
+#endif
+        if (!openFiles())
+            reset();
+    }
+
+    ~DiskCache(){
+        stop();
+        index.flush();
+        if (log != nullptr)
+            fclose(log);
+        pthread_mutex_destroy(&mutex);
+    }
+
+    std::string logPath(uint64_t generation) const {
+        return dir + "/data." + std::to_string(generation) + ".log";
+    }
+
+    DiskIndexHeader* header() const {return reinterpret_cast<DiskIndexHeader*>(index.data());}
+    DiskIndexSlot* slots() const {return reinterpret_cast<DiskIndexSlot*>(index.data() + sizeof(DiskIndexHeader));}
+
+    /* roughly one slot for every 2KB we're allowed to keep */
+    size_t slotCount() const {
+        size_t count = 1024;
+        while (count < capacity / 2048)
+            count <<= 1;
+        return count;
+    }
+
+    static size_t indexSize(size_t slots){
+        return sizeof(DiskIndexHeader) + slots * sizeof(DiskIndexSlot);
+    }
+
+    /* maps index.bin and opens the log it points at, false if either isn't usable */
+    bool openFiles(){
+        std::string path = dir + "/index.bin";
+        FILE* probe = fopen(path.c_str(), "rb");
+        DiskIndexHeader existing;
+        bool valid = probe != nullptr && fread(&existing, sizeof(existing), 1, probe) == 1 
+                && existing.magic == DISKCACHE_INDEX_MAGIC && existing.version == DISKCACHE_VERSION 
+                && existing.capacity > 0 && (existing.capacity & (existing.capacity - 1)) == 0;
+        if (probe != nullptr)
+            fclose(probe);
+        if (!valid || !index.open(path, indexSize(existing.capacity)))
+            return false;
+        log = fopen(logPath(header()->generation).c_str(), "a+b");
+        if (log == nullptr)
+            return false;
+        NM_FSEEK(log, 0, SEEK_END);
+        logSize = static_cast<uint64_t>(NM_FTELL(log));
+        diskBytes = logSize;
+        return true;
+    }
+
+    /* starts over with an empty index and log */
+    bool reset(){
+        index.close();
+        if (log != nullptr)
+            fclose(log);
+        log = nullptr;
+        std::string path = dir + "/index.bin";
+        remove(path.c_str());
+        size_t count = slotCount();
+        if (!index.open(path, indexSize(count)))
+            return false;
+        DiskIndexHeader* head = header();
+        memset(index.data(), 0, index.size());
+        head->magic = DISKCACHE_INDEX_MAGIC;
+        head->version = DISKCACHE_VERSION;
+        head->generation = 0;
+        head->capacity = count;
+        head->count = 0;
+        index.flush();
+        remove(logPath(0).c_str());
+        log = fopen(logPath(0).c_str(), "a+b");
+        logSize = 0;
+        diskBytes = 0;
+        return log != nullptr;
+    }
+
+    /* linear probing, returns the slot holding hash or the empty one where it would go, nullptr when full */
+    static DiskIndexSlot* probe(DiskIndexSlot* table, uint64_t capacity, uint64_t hash){
+        for (uint64_t i = 0; i < capacity; i++){
+            DiskIndexSlot* slot = &table[(hash + i) & (capacity - 1)];
+            if (slot->hash == hash || slot->hash == 0)
+                return slot;
+        }
+        return nullptr;
+    }
+
+    static uint64_t slotHash(uint64_t hash){
+        return hash == 0 ? 1 : hash;
+    }
+
+    static uint32_t checksumOf(const std::string &payload){
+        uint64_t hash = fnv1a(payload.data(), payload.size());
+        return static_cast<uint32_t>(hash ^ (hash >> 32));
+    }
+
+    /* reads a whole record back, false if it's torn, corrupt or belongs to some other key */
+    bool readRecord(uint64_t offset, uint64_t length, const std::string &key, DiskRecordHeader *record, std::string *payload){
+        if (log == nullptr || length < sizeof(DiskRecordHeader) || offset + length > logSize)
+            return false;
+        if (NM_FSEEK(log, static_cast<int64_t>(offset), SEEK_SET) != 0 || fread(record, sizeof(*record), 1, log) != 1)
+            return false;
+        payload->resize(static_cast<size_t>(length - sizeof(DiskRecordHeader)));
+        if (!payload->empty() && fread(&(*payload)[0], 1, payload->size(), log) != payload->size())
+            return false;
+        return record->magic == DISKCACHE_RECORD_MAGIC && record->checksum == checksumOf(*payload) 
+            && record->keyLength <= payload->size() && payload->compare(0, record->keyLength, key) == 0;
+    }
+
+    /* Called from send() on a memory miss. When the index has a record under `hash` the request is handed to the 
+     * worker to read it back and this returns true, a busy index (the worker is writing) is just a miss */
+    bool defer(HttpRequest* request, const std::string &key, uint64_t hash){
+        if (pthread_mutex_trylock(&mutex) != 0)
+            return false;
+        DiskIndexSlot* slot = index.data() != nullptr ? probe(slots(), header()->capacity, slotHash(hash)) : nullptr;
+        bool indexed = slot != nullptr && slot->hash != 0;
+        pthread_mutex_unlock(&mutex);
+        if (!indexed)
+            return false;
+        DiskJob* job = new DiskJob();
+        job->request = request;
+        job->key = key;
+        job->hash = hash;
+        return post(job);
+    }
+
+    /* Called on a daemon once a response made it into the memory cache, the worker writes it out */
+    void queueStore(const std::string &key, uint64_t hash, const CacheEntry &entry){
+        DiskJob* job = new DiskJob();
+        job->request = nullptr;
+        job->key = key;
+        job->hash = hash;
+        job->entry = entry;
+        post(job);
+    }
+
+    /* false (and the job is deleted) when the worker is stopping or too far behind */
+    bool post(DiskJob* job){
+        jobs.lock();
+        if (stopping || pending >= DISKCACHE_MAX_PENDING){
+            jobs.unlock();
+            delete job;
+            return false;
+        }
+        jobs.put(job);
+        pending++;
+        jobs.signal();
+        jobs.unlock();
+        return true;
+    }
+
+    /* worker only, waits for the next job, nullptr once stop() was called */
+    DiskJob* nextJob(){
+        jobs.lock();
+        while (jobs.empty() && !stopping)
+            jobs.wait();
+        DiskJob* job = nullptr;
+        if (!stopping){
+            job = jobs.get();
+            jobs.pop();
+            pending--;
+        }
+        jobs.unlock();
+        return job;
+    }
+
+    /* lets the worker finish the job it's on and throws the rest away, requests that were 
+     * waiting on a read go back to the pool like anything else that's in-flight at shutdown */
+    void stop(){
+        jobs.lock();
+        stopping = true;
+        jobs.signal();
+        jobs.unlock();
+        if (started)
+            pthread_join(worker, nullptr);
+        started = false;
+        while (!jobs.empty()){
+            DiskJob* job = jobs.get();
+            jobs.pop();
+            if (job->request != nullptr)
+                RequestPool::shared()->release(job->request);
+            delete job;
+        }
+        pending = 0;
+    }
+
+    /* worker only, reads the record for `key` back into `entry` */
+    bool load(const std::string &key, uint64_t hash, std::chrono::steady_clock::time_point now, CacheEntry *entry){
+        pthread_mutex_lock(&mutex);
+        bool found = false;
+        DiskRecordHeader record;
+        std::string payload;
+        if (index.data() != nullptr){
+            DiskIndexSlot* slot = probe(slots(), header()->capacity, slotHash(hash));
+            found = slot != nullptr && slot->hash != 0 && readRecord(slot->offset, slot->length, key, &record, &payload);
+        }
+        pthread_mutex_unlock(&mutex);
+        if (!found)
+            return false;
+
+        size_t at = record.keyLength;
+        entry->contentType = payload.substr(at, record.contentTypeLength);
+        at += record.contentTypeLength;
+        entry->etag = payload.substr(at, record.etagLength);
+        at += record.etagLength;
+        entry->lastModified = payload.substr(at, record.lastModifiedLength);
+        at += record.lastModifiedLength;
+        entry->body = payload.substr(at);
+        entry->status = record.status;
+        entry->hash = hash;
+        int64_t nowUnix = unixMillis();
+        entry->freshUntil = now + std::chrono::milliseconds(record.freshUntil - nowUnix);
+        entry->staleUntil = now + std::chrono::milliseconds(record.staleUntil - nowUnix);
+        diskHits++;
+        return true;
+    }
+
+    /* worker only */
+    void store(const std::string &key, uint64_t hash, const CacheEntry &entry){
+        if (entry.contentType.size() > 0xFFFF || entry.etag.size() > 0xFFFF || entry.lastModified.size() > 0xFFFF)
+            return;
+        std::string payload;
+        payload.reserve(key.size() + entry.contentType.size() + entry.etag.size() + entry.lastModified.size() + entry.body.size());
+        payload += key;
+        payload += entry.contentType;
+        payload += entry.etag;
+        payload += entry.lastModified;
+        payload += entry.body;
+        if (payload.size() + sizeof(DiskRecordHeader) > capacity / 2)
+            return;
+
+        DiskRecordHeader record;
+        memset(&record, 0, sizeof(record));
+        record.magic = DISKCACHE_RECORD_MAGIC;
+        record.checksum = checksumOf(payload);
+        record.status = entry.status;
+        record.keyLength = static_cast<uint32_t>(key.size());
+        record.bodyLength = entry.body.size();
+        auto now = std::chrono::steady_clock::now();
+        int64_t nowUnix = unixMillis();
+        record.freshUntil = nowUnix + std::chrono::duration_cast<std::chrono::milliseconds>(entry.freshUntil - now).count();
+        record.staleUntil = nowUnix + std::chrono::duration_cast<std::chrono::milliseconds>(entry.staleUntil - now).count();
+        record.contentTypeLength = static_cast<uint16_t>(entry.contentType.size());
+        record.etagLength = static_cast<uint16_t>(entry.etag.size());
+        record.lastModifiedLength = static_cast<uint16_t>(entry.lastModified.size());
+
+        pthread_mutex_lock(&mutex);
+        if (log == nullptr || index.data() == nullptr){
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+        DiskIndexHeader* head = header();
+        DiskIndexSlot* slot = probe(slots(), head->capacity, slotHash(hash));
+        if (slot == nullptr){
+            needsCompaction = true;
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+        /* the record has to be all the way out before the index may point at it */
+        uint64_t offset = logSize;
+        NM_FSEEK(log, 0, SEEK_END);
+        bool written = fwrite(&record, sizeof(record), 1, log) == 1 
+                && fwrite(payload.data(), 1, payload.size(), log) == payload.size() 
+                && fflush(log) == 0;
+        if (!written){
+            /* whatever made it out is garbage now, the checksum makes sure nobody reads it */
+            NM_FSEEK(log, 0, SEEK_END);
+            logSize = static_cast<uint64_t>(NM_FTELL(log));
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+        logSize += sizeof(record) + payload.size();
+        if (slot->hash == 0)
+            head->count++;
+        slot->offset = offset;
+        slot->length = sizeof(record) + payload.size();
+        slot->hash = slotHash(hash);
+        diskBytes = logSize;
+        if (logSize > capacity || head->count * 10 > head->capacity * 7)
+            needsCompaction = true;
+        pthread_mutex_unlock(&mutex);
+    }
+
+    /* worker only, copies the newest records (up to half the cap) into the next generation. 
+     * Lookups that run into it just miss */
+    void compact(){
+        bool expected = true;
+        if (!needsCompaction.compare_exchange_strong(expected, false))
+            return;
+        pthread_mutex_lock(&mutex);
+        if (log == nullptr || index.data() == nullptr){
+            pthread_mutex_unlock(&mutex);
+            return;
+        }
+
+        DiskIndexHeader* head = header();
+        std::vector<DiskIndexSlot> live;
+        for (uint64_t i = 0; i < head->capacity; i++){
+            if (slots()[i].hash != 0)
+                live.push_back(slots()[i]);
+        }
+        /* newest first */
+        std::sort(live.begin(), live.end(), [](const DiskIndexSlot &a, const DiskIndexSlot &b){return a.offset > b.offset;});
+
+        uint64_t generation = head->generation + 1;
+        uint64_t slotCapacity = head->capacity;
+        while (live.size() * 2 > slotCapacity)
+            slotCapacity <<= 1;
+
+        std::string nextLogPath = logPath(generation);
+        std::string nextIndexPath = dir + "/index.tmp";
+        FILE* nextLog = fopen(nextLogPath.c_str(), "wb");
+        MappedFile nextIndex;
+        bool ok = nextLog != nullptr && nextIndex.open(nextIndexPath, indexSize(slotCapacity));
+        if (ok){
+            memset(nextIndex.data(), 0, nextIndex.size());
+            DiskIndexSlot* table = reinterpret_cast<DiskIndexSlot*>(nextIndex.data() + sizeof(DiskIndexHeader));
+            uint64_t written = 0;
+            uint64_t count = 0;
+            std::vector<char> record;
+            for (size_t i = 0; i < live.size() && ok; i++){
+                if (written + live[i].length > capacity / 2)
+                    break;
+                record.resize(static_cast<size_t>(live[i].length));
+                if (NM_FSEEK(log, static_cast<int64_t>(live[i].offset), SEEK_SET) != 0 || fread(record.data(), 1, record.size(), log) != record.size())
+                    continue;
+                ok = fwrite(record.data(), 1, record.size(), nextLog) == record.size();
+                DiskIndexSlot* slot = probe(table, slotCapacity, live[i].hash);
+                slot->hash = live[i].hash;
+                slot->offset = written;
+                slot->length = live[i].length;
+                written += live[i].length;
+                count++;
+            }
+            ok = ok && fflush(nextLog) == 0;
+            DiskIndexHeader* nextHead = reinterpret_cast<DiskIndexHeader*>(nextIndex.data());
+            nextHead->magic = DISKCACHE_INDEX_MAGIC;
+            nextHead->version = DISKCACHE_VERSION;
+            nextHead->generation = generation;
+            nextHead->capacity = slotCapacity;
+            nextHead->count = count;
+            nextIndex.flush();
+        }
+        nextIndex.close();
+        if (nextLog != nullptr)
+            fclose(nextLog);
+
+        if (ok){
+            /* the rename is the commit point, until then the old generation is still what's on disk */
+            uint64_t previous = head->generation;
+            index.close();
+            fclose(log);
+            log = nullptr;
+            std::string indexPath = dir + "/index.bin";
+#ifdef _WIN32
+            ok = MoveFileExA(nextIndexPath.c_str(), indexPath.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+            ok = rename(nextIndexPath.c_str(), indexPath.c_str()) == 0;
+#endif
+            remove((ok ? logPath(previous) : nextLogPath).c_str());
+            if (!openFiles())
+                reset();
+        } else {
+            remove(nextLogPath.c_str());
+            remove(nextIndexPath.c_str());
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+};
+
+
+struct ResponseCache {
+    std::vector<CacheRule> rules;
+    std::vector<std::unique_ptr<CacheShard>> shards;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> staleHits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> revalidated;
+    std::atomic<uint64_t> rejected;
+    std::atomic<size_t> bytes;
+    /* nullptr unless NetQueue::setDiskCachePath() was set */
+    std::unique_ptr<DiskCache> disk;
+
+    ResponseCache(size_t capacity, const std::vector<CacheRule> &cacheRules) : rules(cacheRules), 
+        hits(0), staleHits(0), misses(0), revalidated(0), rejected(0), bytes(0) {
+        for (int i = 0; i < RESPONSECACHE_SHARDS; i++)
+            shards.push_back(std::unique_ptr<CacheShard>(new CacheShard(capacity / RESPONSECACHE_SHARDS)));
+    }
+
+    static std::string keyOf(HttpRequest* req){
+        std::string key = req->getRequestType() == HttpType::POST ? "POST " : "GET ";
+        key += req->getURL();
+        if (req->getRequestType() == HttpType::POST){
+            /* post bodies can be long, a hash of them is plenty to tell them apart */
+            char hash[20];
+            snprintf(hash, sizeof(hash), " %016llx", static_cast<unsigned long long>(fnv1a(req->getPostFields().data(), req->getPostFields().size())));
+            key += hash;
+        }
+        return key;
+    }
+
+    const CacheRule* ruleFor(HttpRequest* req) const {
+        for (size_t i = 0; i < rules.size(); i++){
+            if (req->getURL().find(rules[i].pattern) != std::string::npos)
+                return &rules[i];
+        }
+        return nullptr;
+    }
+
+    /* works out how long a response may be kept for, false if it shouldn't be stored at all */
+    bool policyFor(HttpRequest* req, HttpResponse* resp, int64_t *ttl, int64_t *stale) const {
+        const CacheRule* rule = ruleFor(req);
+        if (rule != nullptr){
+            *ttl = rule->ttl;
+            *stale = rule->staleWhileRevalidate;
+            return rule->ttl > 0;
+        }
+        /* without a rule only GETs are cached, and only when the server is alright with it */
+        if (req->getRequestType() != HttpType::GET || resp->cacheControl.find("no-store") != std::string::npos)
+            return false;
+        *ttl = cacheControlSeconds(resp->cacheControl, "max-age");
+        *stale = cacheControlSeconds(resp->cacheControl, "stale-while-revalidate");
+        if (*stale < 0)
+            *stale = 0;
+        if (*ttl < 0 || resp->cacheControl.find("no-cache") != std::string::npos){
+            /* nothing fresh about it but it can still be revalidated later */
+            *ttl = 0;
+            return !resp->etag.empty() || !resp->lastModified.empty();
+        }
+        return true;
+    }
+
+    CacheShard* shardOf(uint64_t hash){
+        return shards[hash % shards.size()].get();
+    }
+
+    /* Called from send(). Returns a ready to deliver response on a hit, otherwise nullptr and the request 
+     * is left to go out (with validators added when a stale GET can be revalidated). A stale hit that's 
+     * still inside its stale-while-revalidate window also hands back a copy of the request in `refresh` 
+     * that has to be sent to update the entry. `deferred` comes back true when the request went to the 
+     * disk worker instead, which calls back in with `diskChecked` set once it's read the record */
+    HttpResponse* lookup(HttpRequest* req, HttpRequest** refresh, bool diskChecked, bool* deferred){
+        std::string key = keyOf(req);
+        uint64_t hash = fnv1a(key.data(), key.size());
+        CacheShard* shard = shardOf(hash);
+        auto now = std::chrono::steady_clock::now();
+
+        pthread_mutex_lock(&shard->mutex);
+        if (!diskChecked)
+            shard->sketch.increment(hash);
+        auto found = shard->entries.find(key);
+        if (found == shard->entries.end() && disk && !diskChecked){
+            /* not in memory, maybe a previous run left it on disk */
+            pthread_mutex_unlock(&shard->mutex);
+            if (disk->defer(req, key, hash)){
+                *deferred = true;
+                return nullptr;
+            }
+            pthread_mutex_lock(&shard->mutex);
+            found = shard->entries.find(key);
+        }
+        if (found == shard->entries.end()){
+            pthread_mutex_unlock(&shard->mutex);
+            misses++;
+            return nullptr;
+        }
+
+        CacheEntry &entry = found->second;
+        bool fresh = now < entry.freshUntil;
+        if (!fresh && now >= entry.staleUntil){
+            /* too old to hand out, a GET can at least ask whether it changed */
+            if (req->getRequestType() == HttpType::GET){
+                if (!entry.etag.empty())
+                    req->addValidator("If-None-Match: " + entry.etag);
+                if (!entry.lastModified.empty())
+                    req->addValidator("If-Modified-Since: " + entry.lastModified);
+            }
+            pthread_mutex_unlock(&shard->mutex);
+            misses++;
+            return nullptr;
+        }
+
+        shard->touch(entry);
+        HttpResponse* resp = new HttpResponse();
+        resp->data = BufferPool::shared()->acquire(entry.body.size());
+        resp->data.append(entry.body);
+        resp->status = entry.status;
+        resp->contentType = entry.contentType;
+        resp->etag = entry.etag;
+        resp->lastModified = entry.lastModified;
+
+        if (!fresh && !entry.revalidating){
+            entry.revalidating = true;
+            HttpRequest* copy = RequestPool::shared()->acquire();
+            *copy = *req;
+            copy->setCallback(nullptr);
+            copy->setSink(nullptr);
+            copy->setCacheMode(HttpCacheMode::REFRESH);
+            copy->setPriority(HttpPriority::PREFETCH);
+            if (req->getRequestType() == HttpType::GET){
+                if (!entry.etag.empty())
+                    copy->addValidator("If-None-Match: " + entry.etag);
+                if (!entry.lastModified.empty())
+                    copy->addValidator("If-Modified-Since: " + entry.lastModified);
+            }
+            *refresh = copy;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+
+        (fresh ? hits : staleHits)++;
+        resp->contentLength = static_cast<int64_t>(resp->data.size());
+        resp->success = true;
+        resp->cached = true;
+        resp->setRequest(req);
+        return resp;
+    }
+
+    /* Called on the disk worker with a record it read back, on a warm start anything too old 
+     * to hand out is shown anyway while it gets refreshed */
+    void warm(const std::string &key, CacheEntry &loaded, std::chrono::steady_clock::time_point now){
+        if (now >= loaded.staleUntil)
+            loaded.staleUntil = now + std::chrono::seconds(1);
+        loaded.charge = loaded.body.size() + key.size() + RESPONSECACHE_ENTRY_OVERHEAD;
+        CacheShard* shard = shardOf(loaded.hash);
+        pthread_mutex_lock(&shard->mutex);
+        if (shard->entries.find(key) == shard->entries.end()){
+            uint64_t turnedAway = 0;
+            shard->insert(key, loaded, &turnedAway);
+            rejected += turnedAway;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        recount();
+    }
+
+    /* Called on the daemon once a transfer is done, stores what came back or 
+     * fills a 304 in with the body we already have */
+    void complete(HttpResponse* resp){
+        HttpRequest* req = resp->getRequest();
+        if (req->getCacheMode() == HttpCacheMode::BYPASS)
+            return;
+        bool notModified = resp->status == 304;
+        /* bodies that went to a sink or a spill file never made it into `data` */
+        if (!notModified && (!resp->success || resp->status != 200 || req->getSink() != nullptr || resp->isSpilled())){
+            if (req->getCacheMode() == HttpCacheMode::REFRESH)
+                stopRevalidating(req);
+            return;
+        }
+
+        std::string key = keyOf(req);
+        uint64_t hash = fnv1a(key.data(), key.size());
+        CacheShard* shard = shardOf(hash);
+        int64_t ttl = 0, stale = 0;
+        bool storable = policyFor(req, resp, &ttl, &stale);
+        auto now = std::chrono::steady_clock::now();
+
+        pthread_mutex_lock(&shard->mutex);
+        auto found = shard->entries.find(key);
+        if (notModified){
+            if (found != shard->entries.end()){
+                CacheEntry &entry = found->second;
+                resp->data = BufferPool::shared()->acquire(entry.body.size());
+                resp->data.append(entry.body);
+                resp->status = entry.status;
+                resp->contentType = entry.contentType;
+                resp->success = true;
+                resp->cached = true;
+                if (!storable){
+                    ttl = 0;
+                    stale = 0;
+                }
+                entry.freshUntil = now + std::chrono::seconds(ttl);
+                entry.staleUntil = entry.freshUntil + std::chrono::seconds(stale);
+                entry.revalidating = false;
+                revalidated++;
+            }
+            pthread_mutex_unlock(&shard->mutex);
+            return;
+        }
+
+        if (!storable){
+            if (found != shard->entries.end())
+                shard->erase(&found->first);
+            pthread_mutex_unlock(&shard->mutex);
+            recount();
+            return;
+        }
+
+        CacheEntry entry;
+        entry.body = resp->data;
+        entry.contentType = resp->contentType;
+        entry.etag = resp->etag;
+        entry.lastModified = resp->lastModified;
+        entry.status = resp->status;
+        entry.hash = hash;
+        entry.freshUntil = now + std::chrono::seconds(ttl);
+        entry.staleUntil = entry.freshUntil + std::chrono::seconds(stale);
+        entry.charge = resp->data.size() + key.size() + RESPONSECACHE_ENTRY_OVERHEAD;
+        uint64_t turnedAway = 0;
+        if (disk){
+            /* the disk tier keeps its own copy whether or not memory has room for it */
+            pthread_mutex_unlock(&shard->mutex);
+            disk->queueStore(key, hash, entry);
+            pthread_mutex_lock(&shard->mutex);
+        }
+        shard->insert(key, entry, &turnedAway);
+        rejected += turnedAway;
+        pthread_mutex_unlock(&shard->mutex);
+        recount();
+    }
+
+    /* a background refresh fell through, let the next stale hit try again */
+    void stopRevalidating(HttpRequest* req){
+        std::string key = keyOf(req);
+        CacheShard* shard = shardOf(fnv1a(key.data(), key.size()));
+        pthread_mutex_lock(&shard->mutex);
+        auto found = shard->entries.find(key);
+        if (found != shard->entries.end())
+            found->second.revalidating = false;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    /* only needed for getStats() so it doesn't have to be exact */
+    void recount(){
+        size_t total = 0;
+        for (size_t i = 0; i < shards.size(); i++)
+            total += shards[i]->windowBytes + shards[i]->mainBytes;
+        bytes = total;
+    }
+};
+
+
+/* a request that's out on a daemon and the identical ones that are waiting on it */
+struct Flight {
+    HttpRequest* leader;
+    std::vector<HttpRequest*> followers;
+};
+
+struct InflightTable {
+    pthread_mutex_t mutex;
+    std::unordered_map<std::string, Flight> flights;
+    std::atomic<uint64_t> coalesced;
+
+    InflightTable() : coalesced(0) {
+        pthread_mutex_init(&mutex, nullptr);
+    }
+
+    /* flights that were abandoned at shutdown never landed, their followers are still ours */
+    ~InflightTable(){
+        for (auto it = flights.begin(); it != flights.end(); ++it){
+            for (size_t i = 0; i < it->second.followers.size(); i++)
+                RequestPool::shared()->release(it->second.followers[i]);
+        }
+        pthread_mutex_destroy(&mutex);
+    }
+
+    /* The cache's key plus the headers and whatever else changes what comes back. Two requests that only differ
+     * by an auth header, the proxy they go through, their timeout, body cap or retries aren't the same request */
+    static std::string keyOf(HttpRequest* req){
+        std::string key = ResponseCache::keyOf(req);
+        /* the arena is the headers back to back, each with its NUL */
+        const char* arena = req->getHeaderArena();
+        size_t length = 0;
+        for (size_t i = 0; i < req->getHeaderCount(); i++)
+            length += strlen(arena + length) + 1;
+        uint64_t proxies = fnv1a(req->getProxy().data(), req->getProxy().size());
+        if (req->getHedge())
+            proxies = fnv1a(req->getHedgeProxy().data(), req->getHedgeProxy().size(), fnv1a("\n", 1, proxies));
+        char transport[128];
+        snprintf(transport, sizeof(transport), " %016llx %016llx %d %llu %d %d %d",
+            static_cast<unsigned long long>(fnv1a(arena, length)), static_cast<unsigned long long>(proxies),
+            req->getTimeout(), static_cast<unsigned long long>(req->getMaxBodySize()),
+            req->getMaxAttempts(), req->getIdempotent() ? 1 : 0, req->getHedge() ? 1 : 0);
+        key += transport;
+        return key;
+    }
+
+    /* Called from send(). true if `req` was attached to an identical request that's already in-flight 
+     * and mustn't be routed, otherwise `req` becomes the one others get attached to */
+    bool join(HttpRequest* req){
+        if (req->getSink() != nullptr)
+            return false;
+        std::string key = keyOf(req);
+        pthread_mutex_lock(&mutex);
+        auto found = flights.find(key);
+        if (found != flights.end()){
+            /* the leader may still be sitting in a lower lane where a click would wait behind all the bulk work, 
+             * so a more urgent request goes out itself and takes the flight (and its followers) over. 
+             * The old leader still lands but land() only fans out for the current one */
+            if (req->getPriority() < found->second.leader->getPriority()){
+                found->second.leader = req;
+                pthread_mutex_unlock(&mutex);
+                return false;
+            }
+            found->second.followers.push_back(req);
+            pthread_mutex_unlock(&mutex);
+            coalesced++;
+            return true;
+        }
+        Flight flight;
+        flight.leader = req;
+        flights.emplace(std::move(key), std::move(flight));
+        pthread_mutex_unlock(&mutex);
+        return false;
+    }
+
+    /* Called on the daemon once `resp` is complete but before it's delivered, makes a response 
+     * sharing its body for everything that was waiting on it */
+    void land(HttpResponse* resp, std::vector<HttpResponse*> &fanout){
+        HttpRequest* req = resp->getRequest();
+        if (req->getSink() != nullptr)
+            return;
+        std::vector<HttpRequest*> followers;
+        std::string key = keyOf(req);
+        pthread_mutex_lock(&mutex);
+        auto found = flights.find(key);
+        if (found != flights.end() && found->second.leader == req){
+            followers.swap(found->second.followers);
+            flights.erase(found);
+        }
+        pthread_mutex_unlock(&mutex);
+
+        for (size_t i = 0; i < followers.size(); i++){
+            HttpResponse* follower = new HttpResponse();
+            follower->setRequest(followers[i]);
+            resp->shareBody(follower);
+            /* the network side is the leader's, the wait is still its own */
+            follower->timing = resp->timing;
+            follower->timing.submitted = followers[i]->getSubmitted();
+            follower->timing.dequeued = resp->timing.dequeued;
+            fanout.push_back(follower);
+        }
+    }
+};
+
+
+/* the registry's hash table, only so many of its slots get used so probing for a series stays short */
+#define METRICS_SLOTS 1024
+#define METRICS_MAX_SERIES 768
+
+/* labels for HttpError in the same order as the enum */
+static const char* HTTP_ERROR_NAMES[HTTP_ERROR_KINDS] = {"none", "dns", "connect", "tls", "timeout", "network", "server", "rate_limited", "client", "other"};
+
+size_t HistogramSnapshot::bucketOf(uint64_t value){
+    if (value < 8)
+        return static_cast<size_t>(value);
+    if (value >= (1ULL << 40))
+        return METRICS_HISTOGRAM_BUCKETS - 1;
+    int exponent = 3;
+    while ((value >> (exponent + 1)) != 0)
+        exponent++;
+    return static_cast<size_t>((exponent - 2) * 8) + static_cast<size_t>((value >> (exponent - 3)) & 7);
+}
+
+uint64_t HistogramSnapshot::bucketEnd(size_t bucket){
+    if (bucket < 8)
+        return bucket + 1;
+    int exponent = static_cast<int>(bucket / 8) + 2;
+    return static_cast<uint64_t>(9 + bucket % 8) << (exponent - 3);
+}
+
+uint64_t HistogramSnapshot::percentile(double p) const {
+    if (count == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(std::ceil(std::min(1.0, std::max(0.0, p)) * count));
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++){
+        seen += buckets[i];
+        /* the top of the bucket it landed in, but never past the biggest value we've actually seen */
+        if (seen >= rank)
+            return std::min(bucketEnd(i) - 1, highest);
+    }
+    return highest;
+}
+
+/* A histogram the daemons can record into at the same time as getMetrics() copies it out */
+struct LatencyHistogram {
+    std::atomic<uint64_t> buckets[METRICS_HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> highest;
+
+    LatencyHistogram() : sum(0), highest(0) {
+        for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++)
+            buckets[i].store(0, std::memory_order_relaxed);
+    }
+
+    void record(int64_t value){
+        uint64_t v = value > 0 ? static_cast<uint64_t>(value) : 0;
+        buckets[HistogramSnapshot::bucketOf(v)].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+        uint64_t seen = highest.load(std::memory_order_relaxed);
+        while (v > seen && !highest.compare_exchange_weak(seen, v, std::memory_order_relaxed)){}
+    }
+
+    /* the count is added up from the buckets so it always agrees with them, even mid-update */
+    void copyTo(HistogramSnapshot &snapshot) const {
+        snapshot.buckets.resize(METRICS_HISTOGRAM_BUCKETS);
+        snapshot.count = 0;
+        for (size_t i = 0; i < METRICS_HISTOGRAM_BUCKETS; i++){
+            snapshot.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+            snapshot.count += snapshot.buckets[i];
+        }
+        snapshot.sum = sum.load(std::memory_order_relaxed);
+        snapshot.highest = highest.load(std::memory_order_relaxed);
+    }
+};
+
+/* one tag and host's worth of metrics, the strings never change once it's been published */
+struct MetricsEntry {
+    std::string tag;
+    std::string host;
+    uint64_t hash;
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> errors[HTTP_ERROR_KINDS];
+    std::atomic<uint64_t> retries;
+    std::atomic<uint64_t> cacheHits;
+    std::atomic<uint64_t> connectionsReused;
+    std::atomic<uint64_t> bytesSent;
+    std::atomic<uint64_t> bytesReceived;
+    LatencyHistogram queued;
+    LatencyHistogram firstByte;
+    LatencyHistogram total;
+
+    MetricsEntry(const std::string &entryTag, const std::string &entryHost, uint64_t entryHash) : tag(entryTag), host(entryHost), hash(entryHash), 
+        requests(0), retries(0), cacheHits(0), connectionsReused(0), bytesSent(0), bytesReceived(0) {
+        for (int i = 0; i < HTTP_ERROR_KINDS; i++)
+            errors[i].store(0, std::memory_order_relaxed);
+    }
+
+    void copyTo(MetricsSeries &series) const {
+        series.tag = tag;
+        series.host = host;
+        series.requests = requests.load(std::memory_order_relaxed);
+        for (int i = 0; i < HTTP_ERROR_KINDS; i++)
+            series.errors[i] = errors[i].load(std::memory_order_relaxed);
+        series.retries = retries.load(std::memory_order_relaxed);
+        series.cacheHits = cacheHits.load(std::memory_order_relaxed);
+        series.connectionsReused = connectionsReused.load(std::memory_order_relaxed);
+        series.bytesSent = bytesSent.load(std::memory_order_relaxed);
+        series.bytesReceived = bytesReceived.load(std::memory_order_relaxed);
+        queued.copyTo(series.queued);
+        firstByte.copyTo(series.firstByte);
+        total.copyTo(series.total);
+    }
+};
+
+/* An open-addressed table of MetricsEntry that only ever grows, a new entry is published with a 
+ * compare-exchange on its slot so every daemon (and send() for cache hits) can find or add one 
+ * without a lock and getMetrics() can walk it at any time. Entries live as long as the NetQueue */
+struct MetricsRegistry {
+    std::atomic<MetricsEntry*> slots[METRICS_SLOTS];
+    std::atomic<int32_t> used;
+    /* where everything goes once METRICS_MAX_SERIES pairs are taken */
+    MetricsEntry overflow;
+
+    MetricsRegistry() : used(0), overflow("*", "*", 0) {
+        for (size_t i = 0; i < METRICS_SLOTS; i++)
+            slots[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~MetricsRegistry(){
+        for (size_t i = 0; i < METRICS_SLOTS; i++)
+            delete slots[i].load(std::memory_order_relaxed);
+    }
+
+    MetricsEntry* entryFor(const std::string &tag, const std::string &host){
+        /* the tag's '\0' goes into the hash too so "ab" + "c" and "a" + "bc" don't collide */
+        uint64_t hash = fnv1a(host.data(), host.size(), fnv1a(tag.c_str(), tag.size() + 1));
+        MetricsEntry* fresh = nullptr;
+        size_t slot = static_cast<size_t>(hash % METRICS_SLOTS);
+        for (size_t probe = 0; probe < METRICS_SLOTS; probe++, slot = (slot + 1) % METRICS_SLOTS){
+            MetricsEntry* entry = slots[slot].load(std::memory_order_acquire);
+            if (entry == nullptr){
+                if (used.load(std::memory_order_relaxed) >= METRICS_MAX_SERIES)
+                    break;
+                if (fresh == nullptr)
+                    fresh = new MetricsEntry(tag, host, hash);
+                if (slots[slot].compare_exchange_strong(entry, fresh, std::memory_order_acq_rel)){
+                    used.fetch_add(1, std::memory_order_relaxed);
+                    return fresh;
+                }
+                /* somebody else got the slot first, entry is now whatever they put there */
+            }
+            if (entry->hash == hash && entry->tag == tag && entry->host == host){
+                delete fresh;
+                return entry;
+            }
+        }
+        delete fresh;
+        return &overflow;
+    }
+
+    /* a response the daemon is done with, right before it's handed over */
+    void recordResponse(HttpResponse* response){
+        HttpRequest* request = response->getRequest();
+        MetricsEntry* entry = entryFor(request->getTag(), hostOf(request->getURL()));
+        const HttpTiming &timing = response->timing;
+        entry->requests.fetch_add(1, std::memory_order_relaxed);
+        entry->errors[static_cast<int>(response->error)].fetch_add(1, std::memory_order_relaxed);
+        if (timing.reused)
+            entry->connectionsReused.fetch_add(1, std::memory_order_relaxed);
+        entry->bytesSent.fetch_add(timing.bytesSent, std::memory_order_relaxed);
+        entry->bytesReceived.fetch_add(timing.bytesReceived, std::memory_order_relaxed);
+        entry->queued.record(timing.queued());
+        /* a transfer that never heard back has nothing to say about either of these */
+        if (timing.firstByte > 0)
+            entry->firstByte.record(timing.firstByte);
+        if (timing.total > 0)
+            entry->total.record(timing.total);
+    }
+
+    void recordRetry(HttpRequest* request){
+        entryFor(request->getTag(), hostOf(request->getURL()))->retries.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void recordCacheHit(HttpRequest* request){
+        entryFor(request->getTag(), hostOf(request->getURL()))->cacheHits.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void snapshot(MetricsSnapshot &out) const {
+        for (size_t i = 0; i < METRICS_SLOTS; i++){
+            MetricsEntry* entry = slots[i].load(std::memory_order_acquire);
+            if (entry == nullptr)
+                continue;
+            out.series.push_back(MetricsSeries());
+            entry->copyTo(out.series.back());
+        }
+        if (overflow.requests.load(std::memory_order_relaxed) > 0 || overflow.cacheHits.load(std::memory_order_relaxed) > 0 
+                || overflow.retries.load(std::memory_order_relaxed) > 0){
+            out.series.push_back(MetricsSeries());
+            overflow.copyTo(out.series.back());
+        }
+    }
+};
+
+/* the Prometheus histogram buckets in microseconds, 1ms up to 10s */
+static const uint64_t PROMETHEUS_BOUNDS[] = {1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+
+/* label values may have backslashes, quotes and newlines in them which Prometheus wants escaped */
+static void appendLabel(std::string &out, const char* name, const std::string &value){
+    out += name;
+    out += "=\"";
+    for (size_t i = 0; i < value.size(); i++){
+        switch (value[i]){
+            case '\\': out += "\\\\"; break;
+            case '"': out += "\\\""; break;
+            case '\n': out += "\\n"; break;
+            default: out += value[i]; break;
+        }
+    }
+    out += '"';
+}
+
+std::string MetricsSnapshot::toPrometheus() const {
+    std::string out;
+    char number[64];
+    auto labels = [&](const MetricsSeries &s){
+        out += '{';
+        appendLabel(out, "tag", s.tag);
+        out += ',';
+        appendLabel(out, "host", s.host);
+    };
+    auto counter = [&](const char* name, const char* help, uint64_t MetricsSeries::*field){
+        out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+        out += "# TYPE "; out += name; out += " counter\n";
+        for (size_t i = 0; i < series.size(); i++){
+            out += name;
+            labels(series[i]);
+            snprintf(number, sizeof(number), "} %llu\n", static_cast<unsigned long long>(series[i].*field));
+            out += number;
+        }
+    };
+    /* a fine bucket counts towards the first boundary that its whole range fits under */
+    auto histogram = [&](const char* name, const char* help, HistogramSnapshot MetricsSeries::*field){
+        out += "# HELP "; out += name; out += ' '; out += help; out += '\n';
+        out += "# TYPE "; out += name; out += " histogram\n";
+        for (size_t i = 0; i < series.size(); i++){
+            const HistogramSnapshot &h = series[i].*field;
+            uint64_t cumulative = 0;
+            size_t bucket = 0;
+            for (size_t b = 0; b < sizeof(PROMETHEUS_BOUNDS) / sizeof(PROMETHEUS_BOUNDS[0]); b++){
+                while (bucket < h.buckets.size() && HistogramSnapshot::bucketEnd(bucket) - 1 <= PROMETHEUS_BOUNDS[b])
+                    cumulative += h.buckets[bucket++];
+                out += name; out += "_bucket";
+                labels(series[i]);
+                snprintf(number, sizeof(number), ",le=\"%g\"} %llu\n", PROMETHEUS_BOUNDS[b] / 1000000.0, static_cast<unsigned long long>(cumulative));
+                out += number;
+            }
+            out += name; out += "_bucket";
+            labels(series[i]);
+            snprintf(number, sizeof(number), ",le=\"+Inf\"} %llu\n", static_cast<unsigned long long>(h.count));
+            out += number;
+            out += name; out += "_sum";
+            labels(series[i]);
+            snprintf(number, sizeof(number), "} %.6f\n", h.sum / 1000000.0);
+            out += number;
+            out += name; out += "_count";
+            labels(series[i]);
+            snprintf(number, sizeof(number), "} %llu\n", static_cast<unsigned long long>(h.count));
+            out += number;
+        }
+    };
+
+    counter("networkmanager_requests_total", "Requests that finished after going out to the network.", &MetricsSeries::requests);
+    out += "# HELP networkmanager_errors_total Finished requests by how they went wrong, error=\"none\" didn't.\n";
+    out += "# TYPE networkmanager_errors_total counter\n";
+    for (size_t i = 0; i < series.size(); i++){
+        for (int kind = 0; kind < HTTP_ERROR_KINDS; kind++){
+            if (series[i].errors[kind] == 0)
+                continue;
+            out += "networkmanager_errors_total";
+            labels(series[i]);
+            out += ',';
+            appendLabel(out, "error", HTTP_ERROR_NAMES[kind]);
+            snprintf(number, sizeof(number), "} %llu\n", static_cast<unsigned long long>(series[i].errors[kind]));
+            out += number;
+        }
+    }
+    counter("networkmanager_retries_total", "Failed attempts that were sent out again.", &MetricsSeries::retries);
+    counter("networkmanager_cache_hits_total", "Requests answered by the response cache.", &MetricsSeries::cacheHits);
+    counter("networkmanager_connections_reused_total", "Requests that rode on an already open connection.", &MetricsSeries::connectionsReused);
+    counter("networkmanager_sent_bytes_total", "Bytes sent, headers included.", &MetricsSeries::bytesSent);
+    counter("networkmanager_received_bytes_total", "Bytes received, headers included.", &MetricsSeries::bytesReceived);
+    histogram("networkmanager_queue_seconds", "Time spent queued before a daemon started on the request.", &MetricsSeries::queued);
+    histogram("networkmanager_first_byte_seconds", "Time from the start of the transfer to the first byte of the response.", &MetricsSeries::firstByte);
+    histogram("networkmanager_transfer_seconds", "Time from the start of the transfer to the end of it.", &MetricsSeries::total);
+    return out;
+}
+
+
+/* how long an idle daemon sleeps when there's nothing at all for it to do, 
+ * it's woken up by send() and CloseDaemon() so this is only a backstop */
+#define NETQUEUE_IDLE_MS (60 * 60 * 1000)
+
+/* how often a daemon retries handing over responses when the main-thread has let its ring fill up */
+#define NETQUEUE_BACKLOG_MS 10
+
+
+void* NetQueue::RaiiThread(void *args){
+
+    NetShard* shard = reinterpret_cast<NetShard*>(args);
+    NetQueue* netq = shard->netq;
+    CURLSH* share = shard->share;
+    CURLM* multi = shard->multi;
+    CurlPool pool(netq);
+    if (netq->getHttp2()){
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+        curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS, static_cast<long>(netq->getMaxStreams() > 0 ? netq->getMaxStreams() : 1));
+    } else {
+        curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_NOTHING);
+    }
+    auto lastReap = std::chrono::steady_clock::now();
+    std::vector<HttpRequest*> admitted;
+    /* everything curl_multi is currently driving */
+    std::vector<Transfer*> transfers;
+    /* responses made for coalesced requests when the one they were waiting on lands */
+    std::vector<HttpResponse*> fanout;
+
+    /* sets a transfer's handle up and hands it to curl_multi */
+    auto prepare = [&](Transfer* transfer) -> bool {
+        HttpRequest* request = transfer->response->getRequest();
+        transfer->response->setSpillThreshold(netq->getSpillThreshold());
+        bool ok;
+        switch (request->getRequestType()) {
+            case HttpType::GET: {
+                ok = prepareGetRequest(transfer->curl, request, transfer->response);
+                break;
+            }
+
+            default: /* HttpType::Post */
+                ok = preparePostRequest(transfer->curl, request, transfer->response);
+                break;
+        }
+
+        /* idle keep-alive connections older than this get closed instead of reused */
+        return ok && transfer->curl.setOption(CURLOPT_MAXAGE_CONN, static_cast<long>(netq->getIdleTimeout()))
+                && transfer->curl.setOption(CURLOPT_SHARE, share)
+                /* an empty cookie file turns on curl's cookie engine so the shared jar gets used */
+                && transfer->curl.setOption(CURLOPT_COOKIEFILE, "")
+                && transfer->curl.setOption(CURLOPT_PRIVATE, reinterpret_cast<void*>(transfer))
+                && transfer->curl.setOption(CURLOPT_HEADERFUNCTION, HttpResponse::header_callback)
+                && transfer->curl.setOption(CURLOPT_HEADERDATA, reinterpret_cast<void*>(transfer->response))
+                && (!netq->getHttp2() || prepareHttp2(transfer->curl, request))
+                && curl_multi_add_handle(multi, transfer->curl.m_curl) == CURLM_OK;
+    };
+
+    /* swap-removes a transfer that curl is done with from the in-flight list and frees it (and its response if it still has one) */
+    auto retire = [&](Transfer* transfer){
+        transfers[transfer->slot] = transfers.back();
+        transfers[transfer->slot]->slot = transfer->slot;
+        transfers.pop_back();
+        pool.release(transfer->curl.detach());
+        delete transfer;
+    };
+
+    /* the hedge won (or is the one still going), it takes the original request over from its twin so 
+     * the callback, the cache and any coalesced followers see the request they know about */
+    auto adopt = [&](Transfer* winner, Transfer* loser){
+        if (!winner->hedge)
+            return;
+        HttpRequest* original = loser->response->releaseRequest();
+        RequestPool::shared()->release(winner->response->releaseRequest());
+        winner->response->setRequest(original);
+        winner->response->attempts = original->getAttempts();
+        winner->hedge = false;
+        winner->started = loser->started;
+    };
+
+    while (true){
+        /* daemon check */
+        if (netq->ShouldCloseDaemon())
+            break;
+
+        bool backlogged = !shard->flushBacklog();
+
+        /* admit as many queued requests as our concurrency window allows, 
+         * the last few slots are held back for interactive requests */
+        auto now = std::chrono::steady_clock::now();
+        int32_t window = netq->getMaxConcurrency() > 0 ? netq->getMaxConcurrency() : 1;
+        int32_t reserved = netq->getReservedSlots() < window ? netq->getReservedSlots() : window - 1;
+        while ((int32_t)(transfers.size() + admitted.size()) < window){
+            int32_t freeSlots = window - (int32_t)(transfers.size() + admitted.size());
+            /* retries that are done waiting go first, they were sent before anything still in the queue */
+            HttpRequest* request = freeSlots > reserved ? shard->dueRetry(now) : nullptr;
+            if (request != nullptr){
+                /* a host that isn't ready would only turn it away, it waits in the limiter instead */
+                if (!shard->limiter.admit(request, now)) continue;
+            } else {
+                /* then the lanes, each one's held back requests go before whatever is still queued in it */
+                request = shard->nextRequest(now, freeSlots <= reserved, netq->getStarvationLimit());
+                if (request == nullptr) break;
+            }
+            admitted.push_back(request);
+        }
+
+        for (size_t i = 0; i < admitted.size(); i++){
+            admitted[i]->countAttempt();
+            admitted[i]->markDequeued(now);
+            Transfer* transfer = new Transfer(admitted[i], pool.acquire());
+            HttpRequest* request = transfer->response->getRequest();
+
+            if (!prepare(transfer)){
+                /* the response goes out as a failure right away */
+                if (netq->m_cache)
+                    netq->m_cache->complete(transfer->response);
+                transfer->response->curlCode = CURLE_FAILED_INIT;
+                transfer->response->error = HttpError::OTHER;
+                transfer->response->attempts = request->getAttempts();
+                recordTiming(transfer->response, nullptr, now);
+                finishSink(transfer->response);
+                if (netq->m_metrics)
+                    netq->m_metrics->recordResponse(transfer->response);
+                shard->limiter.observe(transfer->response, CURLE_FAILED_INIT, 0, now);
+                if (netq->m_inflight)
+                    netq->m_inflight->land(transfer->response, fanout);
+                shard->deliver(transfer->response);
+                for (size_t j = 0; j < fanout.size(); j++)
+                    shard->deliver(fanout[j]);
+                fanout.clear();
+                transfer->response = nullptr;
+                pool.release(transfer->curl.detach());
+                delete transfer;
+                continue;
+            }
+            transfer->slot = transfers.size();
+            transfers.push_back(transfer);
+
+            if (hedgeable(request)){
+                shard->hedging.started++;
+                double threshold = shard->hedging.threshold(request->getURL(), netq->getHedgePercentile());
+                if (threshold >= 0)
+                    transfer->hedgeAt = transfer->started + std::chrono::microseconds(static_cast<int64_t>(threshold * 1000.0));
+            }
+        }
+        admitted.clear();
+
+        int running = 0;
+        curl_multi_perform(multi, &running);
+
+        /* collect everything that finished during this cycle */
+        CURLMsg* msg;
+        int remaining = 0;
+        bool finishedAny = false;
+        while ((msg = curl_multi_info_read(multi, &remaining)) != nullptr){
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            Transfer* transfer = nullptr;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, reinterpret_cast<char**>(&transfer));
+            /* copy the result off before removing, msg is invalid afterwards */
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(multi, msg->easy_handle);
+
+            HttpResponse* response = transfer->response;
+            response->success = transfer->curl.complete(result, &response->status);
+            response->curlCode = result;
+            response->error = classify(result, response);
+            response->attempts = response->getRequest()->getAttempts();
+            auto finished = std::chrono::steady_clock::now();
+            recordTiming(response, &transfer->curl, finished);
+            shard->limiter.observe(response, result, response->timing.firstByte / 1000000.0, finished);
+
+            if (transfer->twin != nullptr){
+                Transfer* twin = transfer->twin;
+                twin->twin = nullptr;
+                transfer->twin = nullptr;
+                if (!response->success){
+                    /* the other copy is still going and may well do better, it carries on alone */
+                    adopt(twin, transfer);
+                    retire(transfer);
+                    finishedAny = true;
+                    continue;
+                }
+                /* first one back wins, the other copy gets cancelled */
+                if (transfer->hedge)
+                    netq->m_hedgeWins++;
+                adopt(transfer, twin);
+                curl_multi_remove_handle(multi, twin->curl.m_curl);
+                shard->limiter.release(response->getRequest(), finished);
+                retire(twin);
+            }
+            if (response->success && hedgeable(response->getRequest())){
+                shard->hedging.record(response->getRequest()->getURL(), response->timing.firstByte / 1000.0);
+                shard->recordHedged(std::chrono::duration<double, std::milli>(finished - transfer->started).count());
+            }
+
+            int64_t retryMs = retryDelayMs(response, shard->rng);
+            if (retryMs >= 0){
+                /* this attempt gets thrown away and the request goes out again once its backoff is up */
+                if (netq->m_metrics)
+                    netq->m_metrics->recordRetry(response->getRequest());
+                shard->scheduleRetry(response->releaseRequest(), retryMs);
+                delete response;
+                netq->m_retries++;
+            } else {
+                if (netq->m_cache)
+                    netq->m_cache->complete(response);
+                finishSink(response);
+                if (netq->m_metrics)
+                    netq->m_metrics->recordResponse(response);
+                /* the followers have to be made before the response is delivered, visit() may delete it right after */
+                if (netq->m_inflight)
+                    netq->m_inflight->land(response, fanout);
+                shard->deliver(response);
+                for (size_t i = 0; i < fanout.size(); i++)
+                    shard->deliver(fanout[i]);
+                fanout.clear();
+            }
+
+            /* a transfer that didn't need to open anything rode on a kept-alive connection */
+            long connects = 0;
+            if (transfer->curl.getInfo(CURLINFO_NUM_CONNECTS, &connects)){
+                if (connects == 0)
+                    netq->m_connectionsReused++;
+                else
+                    netq->m_connectionsOpened += connects;
+            }
+
+            transfer->response = nullptr;
+            retire(transfer);
+            finishedAny = true;
+        }
+
+        /* hedged transfers that still haven't heard a thing by their endpoint's usual latency get a second copy sent out */
+        now = std::chrono::steady_clock::now();
+        auto nextHedge = std::chrono::steady_clock::time_point::max();
+        for (size_t i = 0, count = transfers.size(); i < count; i++){
+            Transfer* original = transfers[i];
+            if (original->hedgeAt > now){
+                nextHedge = std::min(nextHedge, original->hedgeAt);
+                continue;
+            }
+            original->hedgeAt = std::chrono::steady_clock::time_point::max();
+            curl_off_t firstByte = 0;
+            curl_easy_getinfo(original->curl.m_curl, CURLINFO_STARTTRANSFER_TIME_T, &firstByte);
+            HttpRequest* request = original->response->getRequest();
+            if (firstByte > 0 || (int32_t)transfers.size() >= window || !shard->hedging.withinBudget(netq->getHedgeBudget()) 
+                    || !shard->limiter.tryTake(request, now))
+                continue;
+
+            HttpRequest* copy = RequestPool::shared()->acquire();
+            *copy = *request;
+            if (!request->getHedgeProxy().empty())
+                copy->setProxy(request->getHedgeProxy());
+            Transfer* hedge = new Transfer(copy, pool.acquire());
+            hedge->hedge = true;
+            if (!prepare(hedge)){
+                shard->limiter.release(request, now);
+                pool.release(hedge->curl.detach());
+                delete hedge;
+                continue;
+            }
+            hedge->twin = original;
+            original->twin = hedge;
+            hedge->slot = transfers.size();
+            transfers.push_back(hedge);
+            shard->hedging.hedges++;
+            netq->m_hedges++;
+        }
+
+        /* throw out spare handles that nobody has needed in a while */
+        auto reapInterval = std::chrono::seconds(netq->getReapInterval());
+        if (now - lastReap >= reapInterval){
+            pool.reap(netq->getIdleTimeout());
+            /* give back body buffers the app hasn't needed since it went quiet */
+            BufferPool::shared()->trim(netq->getIdleTimeout());
+            lastReap = now;
+        }
+
+        /* sleep until a socket is ready, curl needs us for one of its timers or somebody 
+         * calls wakeup(). curl_multi_poll already cuts this short for curl's own timers 
+         * so when nothing is in-flight the only reason to wake up is the next reap, 
+         * and that's only needed when a pool is actually holding onto handles or buffers */
+        int sleepMs = NETQUEUE_IDLE_MS;
+        if (finishedAny){
+            /* room just opened up in the window, go straight back around and admit more */
+            sleepMs = 0;
+        } else if (backlogged){
+            /* the main-thread isn't keeping up, check back for room in the ring soon */
+            sleepMs = NETQUEUE_BACKLOG_MS;
+        } else if (!pool.empty() || BufferPool::shared()->pooledBytes() > 0){
+            auto untilReap = std::chrono::duration_cast<std::chrono::milliseconds>(lastReap + reapInterval - now).count();
+            if (untilReap < sleepMs)
+                sleepMs = untilReap > 0 ? static_cast<int>(untilReap) : 0;
+        }
+        shard->limiter.evictIdle(now);
+        int statsMs = shard->publishStats(now);
+        if (statsMs >= 0 && statsMs < sleepMs)
+            sleepMs = statsMs;
+
+        /* and a host's rate limit may be about to let a held request go, or a retry may be due */
+        int heldMs = shard->limiter.untilReadyMs(now);
+        if (heldMs >= 0 && heldMs < sleepMs)
+            sleepMs = heldMs;
+        int retryMs = shard->untilRetryMs(now);
+        if (retryMs >= 0 && retryMs < sleepMs)
+            sleepMs = retryMs;
+        if (nextHedge != std::chrono::steady_clock::time_point::max()){
+            int hedgeMs = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(nextHedge - now).count()) + 1;
+            if (hedgeMs < sleepMs)
+                sleepMs = hedgeMs;
+        }
+        curl_multi_poll(multi, nullptr, 0, sleepMs, nullptr);
+    }
+
+    /* abandon anything still in-flight, curl wants handles removed before cleanup */
+    for (size_t i = 0; i < transfers.size(); i++){
+        curl_multi_remove_handle(multi, transfers[i]->curl.m_curl);
+        finishSink(transfers[i]->response);
+        delete transfers[i];
+    }
+    /* responses that never made it into the ring are never going to now */
+    for (size_t i = 0; i < shard->backlog.size(); i++)
+        delete shard->backlog[i];
+    shard->backlog.clear();
+
+    /* we're the only consumer of our request queue so it's on us to empty it */
+    HttpRequest* leftover;
+    for (int lane = 0; lane < HTTP_PRIORITY_LANES; lane++){
+        while ((leftover = shard->requestQueue[lane].pop()) != nullptr)
+            RequestPool::shared()->release(leftover);
+    }
+    shard->limiter.clear();
+    while (!shard->retries.empty()){
+        RequestPool::shared()->release(shard->retries.top().request);
+        shard->retries.pop();
+    }
+
+    /* every handle has to be gone before the shard lets go of the share */
+    pool.clear();
+
+    /* the last shard out wakes-up the main-thread to drain out all of our queues, 
+     * nothing may touch netq after unlocking since the NetQueue can be deleted right away */
+    netq->mayclose.lock();
+    if (--netq->m_liveShards == 0)
+        netq->mayclose.broadcast();
+    netq->mayclose.unlock();
+    return nullptr;
+}
+
+
+void* NetQueue::DiskThread(void* args){
+    NetQueue* netq = reinterpret_cast<NetQueue*>(args);
+    ResponseCache* cache = netq->m_cache.get();
+    DiskCache* disk = cache->disk.get();
+    DiskJob* job;
+    while ((job = disk->nextJob()) != nullptr){
+        if (job->request == nullptr){
+            disk->store(job->key, job->hash, job->entry);
+        } else {
+            CacheEntry loaded;
+            auto now = std::chrono::steady_clock::now();
+            if (disk->load(job->key, job->hash, now, &loaded))
+                cache->warm(job->key, loaded, now);
+            /* picks up where send() left off, it's a hit now if the record made it into memory */
+            netq->submit(job->request, true);
+        }
+        delete job;
+        /* nothing else ever waits on the files so a log that went past its cap gets compacted right away */
+        if (disk->needsCompaction)
+            disk->compact();
+    }
+    return nullptr;
+}
+
+
+NetQueue::NetQueue(int32_t maxConcurrency, int32_t shardCount) : m_liveShards(0), m_visitCursor(0), 
+    m_cacheHitCount(0), m_nextCacheHit(nullptr), m_peekedCacheHit(false), 
+    m_peekedShard(nullptr), m_peekedShardIndex(0), m_shardCount(shardCount), 
+    m_maxConcurrency(maxConcurrency), m_idleTimeout(60), m_reapInterval(30), m_responseCapacity(1024), 
+    m_reservedSlots(2), m_starvationLimit(32), m_http2(false), m_maxStreams(100), 
+    m_spillThreshold(8 * 1024 * 1024), m_cacheSize(0), 
+    m_diskCachePath(""), m_diskCacheSize(64 * 1024 * 1024), m_coalesce(false), m_maxBackoff(120), m_hostConcurrency(4), 
+    m_hedgePercentile(0.95), m_hedgeBudget(0.05), m_collectMetrics(false), 
+    m_poolHits(0), m_poolMisses(0), m_connectionsReused(0), m_connectionsOpened(0), 
+    m_rateLimited(0), m_throttled(0), m_retries(0), m_hedges(0), m_hedgeWins(0) {}
+
+
+void NetQueue::init(){
+    int32_t count = m_shardCount > 0 ? m_shardCount : 1;
+    m_liveShards = count;
+    threadIsAlive.setValue(true);
+    if (m_cacheSize > 0)
+        m_cache.reset(new ResponseCache(m_cacheSize, m_cacheRules));
+    if (m_cache && !m_diskCachePath.empty() && m_diskCacheSize > 0){
+        m_cache->disk.reset(new DiskCache(m_diskCachePath, m_diskCacheSize));
+        /* without its worker the disk tier turns every job away, so it's just never used */
+        DiskCache* disk = m_cache->disk.get();
+        disk->started = pthread_create(&disk->worker, nullptr, NetQueue::DiskThread, reinterpret_cast<void*>(this)) == 0;
+        if (!disk->started)
+            disk->stopping = true;
+    }
+    if (m_coalesce)
+        m_inflight.reset(new InflightTable());
+    if (m_collectMetrics)
+        m_metrics.reset(new MetricsRegistry());
+    for (int32_t i = 0; i < count; i++){
+        m_shards.push_back(std::unique_ptr<NetShard>(new NetShard(this, m_responseCapacity > 0 ? m_responseCapacity : 1, m_rateLimits)));
+    }
+    for (int32_t i = 0; i < count; i++){
+        pthread_t tid;
+        pthread_create(&tid, nullptr, NetQueue::RaiiThread, reinterpret_cast<void*>(m_shards[i].get()));
+        /* treat tid as a daemon */
+        pthread_detach(tid);
+    }
+    for (size_t i = 0; i < m_early.size(); i++)
+        route(m_early[i]);
+    m_early.clear();
+}
+
+void NetQueue::addCacheRule(const std::string &pattern, int32_t ttl, int32_t staleWhileRevalidate){
+    CacheRule rule;
+    rule.pattern = pattern;
+    rule.ttl = ttl;
+    rule.staleWhileRevalidate = staleWhileRevalidate;
+    m_cacheRules.push_back(rule);
+}
+
+void NetQueue::addRateLimit(const std::string &host, double rate, int32_t burst){
+    RateLimit limit;
+    limit.host = host;
+    for (size_t i = 0; i < limit.host.size(); i++)
+        limit.host[i] = static_cast<char>(tolower(static_cast<unsigned char>(limit.host[i])));
+    limit.rate = rate;
+    limit.burst = burst;
+    m_rateLimits.push_back(limit);
+}
+
+void NetQueue::send(HttpRequest* req){
+    req->markSubmitted(std::chrono::steady_clock::now());
+    submit(req, false);
+}
+
+void NetQueue::submit(HttpRequest* req, bool diskChecked){
+    auto now = std::chrono::steady_clock::now();
+    if (m_cache && req->getCacheMode() == HttpCacheMode::USE){
+        HttpRequest* refresh = nullptr;
+        bool deferred = false;
+        HttpResponse* hit = m_cache->lookup(req, &refresh, diskChecked, &deferred);
+        if (deferred)
+            return;
+        if (refresh != nullptr)
+            route(refresh);
+        if (hit != nullptr){
+            /* answered straight from the cache, the daemons never see it */
+            hit->timing.submitted = req->getSubmitted();
+            hit->timing.dequeued = now;
+            hit->timing.completed = std::chrono::steady_clock::now();
+            if (m_metrics)
+                m_metrics->recordCacheHit(req);
+            m_cacheHits.put(hit);
+            /* counted after it's linked in so the main-thread never sees a count for a hit it can't pop yet */
+            m_cacheHitCount++;
+            return;
+        }
+    }
+    /* an identical request is already out, this one gets its response when that one lands */
+    if (m_inflight && m_inflight->join(req))
+        return;
+    route(req);
+}
+
+void NetQueue::route(HttpRequest* req){
+    /* no shards until init(), the request waits for them like it used to wait in the old queue */
+    if (m_shards.empty()){
+        m_early.push_back(req);
+        return;
+    }
+    /* requests for the same host always go to the same shard so it can keep reusing its connections */
+    NetShard* shard = m_shards[std::hash<std::string>()(hostOf(req->getURL())) % m_shards.size()].get();
+    /* sendoff our http request */
+    shard->requestQueue[static_cast<int>(req->getPriority())].put(req);
+    shard->wakeup();
+}
+
+NetShard* NetQueue::nextResponseShard(size_t* index){
+    for (size_t i = 0; i < m_shards.size(); i++){
+        size_t at = (m_visitCursor + i) % m_shards.size();
+        NetShard* shard = m_shards[at].get();
+        if (!shard->responses.empty()){
+            if (index != nullptr)
+                *index = at;
+            return shard;
+        }
+    }
+    return nullptr;
+}
+
+HttpResponse* NetQueue::getResponse(){
+    /* cache hits are already done so they go first */
+    if (m_nextCacheHit == nullptr && m_cacheHitCount > 0)
+        m_nextCacheHit = m_cacheHits.pop();
+    if (m_nextCacheHit != nullptr){
+        m_peekedCacheHit = true;
+        m_peekedShard = nullptr;
+        return m_nextCacheHit;
+    }
+    m_peekedCacheHit = false;
+    m_peekedShard = nextResponseShard(&m_peekedShardIndex);
+    return m_peekedShard != nullptr ? m_peekedShard->responses.front() : nullptr;
+}
+
+void NetQueue::popResponse(){
+    if (m_peekedCacheHit){
+        m_nextCacheHit = nullptr;
+        m_cacheHitCount--;
+        m_peekedCacheHit = false;
+        return;
+    }
+    /* only ever the one getResponse() handed out, another shard may have filled up in between */
+    if (m_peekedShard == nullptr) return;
+    m_peekedShard->responses.pop();
+    m_peekedShard = nullptr;
+    /* next time start with the shard after this one */
+    m_visitCursor = m_peekedShardIndex + 1;
+}
+
+size_t NetQueue::pendingResponses(){
+    size_t pending = m_cacheHitCount;
+    for (size_t i = 0; i < m_shards.size(); i++)
+        pending += m_shards[i]->responses.size();
+    return pending;
+}
+
+void NetQueue::drainResponses(){
+    HttpResponse* resp;
+    while ((resp = getResponse()) != nullptr){
+        popResponse();
+        delete resp;
+    }
+}
+
+NetStats NetQueue::getStats(){
+    NetStats stats;
+    stats.poolHits = m_poolHits.load();
+    stats.poolMisses = m_poolMisses.load();
+    stats.connectionsReused = m_connectionsReused.load();
+    stats.connectionsOpened = m_connectionsOpened.load();
+    stats.bufferHits = BufferPool::shared()->m_hits.load();
+    stats.bufferMisses = BufferPool::shared()->m_misses.load();
+    stats.bufferBytesPooled = BufferPool::shared()->pooledBytes();
+    stats.requestHits = RequestPool::shared()->m_hits.load();
+    stats.requestMisses = RequestPool::shared()->m_misses.load();
+    stats.cacheHits = m_cache ? m_cache->hits.load() : 0;
+    stats.cacheStaleHits = m_cache ? m_cache->staleHits.load() : 0;
+    stats.cacheMisses = m_cache ? m_cache->misses.load() : 0;
+    stats.cacheRevalidated = m_cache ? m_cache->revalidated.load() : 0;
+    stats.cacheRejected = m_cache ? m_cache->rejected.load() : 0;
+    stats.cacheBytes = m_cache ? m_cache->bytes.load() : 0;
+    stats.cacheDiskHits = m_cache && m_cache->disk ? m_cache->disk->diskHits.load() : 0;
+    stats.cacheDiskBytes = m_cache && m_cache->disk ? m_cache->disk->diskBytes.load() : 0;
+    stats.coalesced = m_inflight ? m_inflight->coalesced.load() : 0;
+    stats.rateLimited = m_rateLimited.load();
+    stats.throttled = m_throttled.load();
+    stats.retries = m_retries.load();
+    stats.hedges = m_hedges.load();
+    stats.hedgeWins = m_hedgeWins.load();
+    std::vector<double> hedgedLatency;
+    for (size_t i = 0; i < m_shards.size(); i++){
+        NetShard* shard = m_shards[i].get();
+        pthread_mutex_lock(&shard->statsMutex);
+        stats.hosts.insert(stats.hosts.end(), shard->hostStats.begin(), shard->hostStats.end());
+        hedgedLatency.insert(hedgedLatency.end(), shard->hedgedLatency.begin(), shard->hedgedLatency.end());
+        pthread_mutex_unlock(&shard->statsMutex);
+    }
+    stats.hedgedP50Ms = percentileOf(hedgedLatency, 0.50);
+    stats.hedgedP99Ms = percentileOf(hedgedLatency, 0.99);
+    return stats;
+}
+
+MetricsSnapshot NetQueue::getMetrics(){
+    MetricsSnapshot snapshot;
+    if (m_metrics)
+        m_metrics->snapshot(snapshot);
+    return snapshot;
+}
+
+bool NetQueue::writeMetrics(const std::string &path){
+    std::string text = getMetrics().toPrometheus();
+    std::string temp = path + ".tmp";
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (file == nullptr)
+        return false;
+    bool ok = fwrite(text.data(), 1, text.size(), file) == text.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok){
+        remove(temp.c_str());
+        return false;
+    }
+    /* rename won't replace a file that's already there on windows */
+    if (rename(temp.c_str(), path.c_str()) != 0){
+        remove(path.c_str());
+        if (rename(temp.c_str(), path.c_str()) != 0){
+            remove(temp.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+/* used to signal that we may need to close the Daemon */
+bool NetQueue::ShouldCloseDaemon(){
+    return m_close == true;
+}
+
+/* signal to have the http threads shutdown */
+void NetQueue::CloseDaemon(){
+    m_close.setValue(true);
+    for (size_t i = 0; i < m_shards.size(); i++)
+        m_shards[i]->wakeup();
+};
+
+void NetQueue::waitForClose(){
+    mayclose.lock();
+    while (m_liveShards > 0)
+        mayclose.wait();
+    mayclose.unlock();
+}
+
+/* shuts down the daemon's lifecycle NOTE: if you set forceShutdown to true you 
+won't wait for the daemons to exit, which is only safe if this NetQueue outlives them. 
+Either way anything still in-flight gets abandoned since the daemons wake up right away.
+*/
+void NetQueue::shutdown(bool forceShutDown){
+    /* the disk worker hands requests to the daemons so it has to be done before they are */
+    if (m_cache && m_cache->disk)
+        m_cache->disk->stop();
+    CloseDaemon();
+    if (!forceShutDown){
+        waitForClose();
+    }
+    
+    /* each daemon empties out its own request queue on the way out */
+    threadIsAlive.setValue(false);
+    drainResponses();
+    
+}
+
+NetQueue::~NetQueue(){
+    /* the daemons still point at us so always wait for them, now that they 
+    wake up as soon as CloseDaemon() is called this doesn't lag anymore */
+    if (threadIsAlive == true){
+        shutdown();
+    }
+    /* a forced shutdown may have left them running, the shards can't go before they're out */
+    waitForClose();
+    drainResponses();
+    /* init() was never called so nobody sent these */
+    for (size_t i = 0; i < m_early.size(); i++)
+        RequestPool::shared()->release(m_early[i]);
+    /* I'll leave up to the compiler on how to destory the other object */
+}
+
+
+/* Used to render data and callbacks you setup during your http requests */
+void networkManager::dispatch(HttpResponse* resp){
+    resp->timing.delivered = std::chrono::steady_clock::now();
+    /* do we have a callback to use? */
+    if (resp->getRequest()->getCallback() != nullptr){
+        responseCallback *cb = resp->getRequest()->getCallback();
+        /* callback to our response */
+        (*cb)(resp);
+    }
+    /* remove the response now... */
+    delete resp;
+}
+
+void networkManager::trimBuffers(){
+    BufferPool::shared()->trim(0);
+    RequestPool::shared()->trim();
+    SlabPool<HttpResponse>::shared()->trim();
+}
+
+void networkManager::visit(){
+    /* this is a 1 response per frame styled visitation so that lag doesn't occur as frequently */
+    /* responses come out of wait-free rings so the render loop never waits on a daemon */
+    HttpResponse* resp = m_nq->getResponse();
+    if (resp == nullptr)
+        return;
+    /* pop out this response */
+    m_nq->popResponse();
+    dispatch(resp);
+}
+
+size_t networkManager::visit(uint32_t budgetMicros, uint32_t maxResponses){
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(budgetMicros);
+    uint32_t delivered = 0;
+    HttpResponse* resp;
+    while ((resp = m_nq->getResponse()) != nullptr){
+        m_nq->popResponse();
+        dispatch(resp);
+        delivered++;
+
+        if (maxResponses != 0 && delivered >= maxResponses)
+            break;
+        if (budgetMicros != 0 && std::chrono::steady_clock::now() >= deadline)
+            break;
     }
+    return m_nq->pendingResponses();
 }
 
 static networkManager* GLOBAL_NETWORKMANAGER;
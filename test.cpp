@@ -34,6 +34,7 @@ int main(int argc, char const *argv[])
     }
 
     auto resp = nq.getResponse();
+    nq.popResponse();
 
     LOG("STATUS:" << resp->status);
     LOG("DATA:" << resp->data);
@@ -0,0 +1,67 @@
+#include <iostream>
+#include "networkManager.hpp"
+#include <chrono>
+#include <string>
+#include <thread>
+
+#include <cassert>
+
+#define LOG(MSG) std::cout << "[DEBUG] " << MSG << std::endl;
+
+/* A host that's being held back mustn't hold up any other host in the same lane. localhost gets 
+ * rate limited down to one request every two seconds and 40 requests go to it first, then 20 
+ * go to 127.0.0.1 in the same lane. Those 20 have to be done long before localhost's are. 
+ * Needs benchServer.py running (python benchServer.py) */
+
+static int limitedDone = 0;
+static int freeDone = 0;
+
+static void onResponse(HttpResponse* resp){
+    assert(resp->success);
+    if (resp->getFlag() == 1)
+        limitedDone++;
+    else
+        freeDone++;
+}
+static responseCallback testCallback = onResponse;
+
+static void sendTo(networkManager &manager, const std::string &host, int flag){
+    HttpRequest* request = manager.newRequest();
+    request->setURL("http://" + host + ":8765/bytes/10");
+    request->setPriority(HttpPriority::BULK);
+    request->setFlag(flag);
+    request->setCallback(&testCallback);
+    manager.send(request);
+}
+
+int main(int argc, char const *argv[])
+{
+    NetQueue* queue = new NetQueue(8);
+    queue->addRateLimit("localhost", 0.5, 1);
+    networkManager manager(queue);
+
+    for (int i = 0; i < 40; i++)
+        sendTo(manager, "localhost", 1);
+    for (int i = 0; i < 20; i++)
+        sendTo(manager, "127.0.0.1", 2);
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::seconds(10);
+    while (freeDone < 20 && std::chrono::steady_clock::now() < deadline){
+        manager.visit(0, 0);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    LOG("127.0.0.1 finished " << freeDone << "/20 in " << ms << "ms while localhost finished " << limitedDone << "/40");
+
+    NetStats stats = manager.getStats();
+    for (size_t i = 0; i < stats.hosts.size(); i++)
+        LOG(stats.hosts[i].host << " held " << stats.hosts[i].held << " in-flight " << stats.hosts[i].inFlight);
+
+    assert(freeDone == 20);
+    assert(ms < 2000);
+    assert(limitedDone < 40);
+    LOG("Finished!")
+    /* localhost's leftovers get abandoned on the way out */
+    return 0;
+}